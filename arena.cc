@@ -0,0 +1,166 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#include "plib.h"
+
+#ifdef HAVE_TLS
+__thread Arena *current_arena_tls = 0;
+static __thread Arena *thread_arena_tls = 0;
+#else
+static pthread_key_t current_arena_key;
+#endif
+static pthread_key_t thread_arena_key;
+static pthread_once_t arena_keys_once = PTHREAD_ONCE_INIT;
+
+static void delete_thread_arena(void *a) { delete (Arena *)a; }
+
+static void make_arena_keys() {
+  pthread_key_create(&thread_arena_key, delete_thread_arena);
+#ifndef HAVE_TLS
+  pthread_key_create(&current_arena_key, 0);
+#endif
+}
+
+#ifndef HAVE_TLS
+Arena *current_arena() {
+  pthread_once(&arena_keys_once, make_arena_keys);
+  return (Arena *)pthread_getspecific(current_arena_key);
+}
+
+void set_current_arena(Arena *a) {
+  pthread_once(&arena_keys_once, make_arena_keys);
+  pthread_setspecific(current_arena_key, a);
+}
+#endif
+
+Arena *thread_arena() {
+#ifdef HAVE_TLS
+  if (thread_arena_tls) return thread_arena_tls;
+#endif
+  pthread_once(&arena_keys_once, make_arena_keys);
+  Arena *a = (Arena *)pthread_getspecific(thread_arena_key);
+  if (!a) {
+    a = new Arena;
+    pthread_setspecific(thread_arena_key, a);
+  }
+#ifdef HAVE_TLS
+  thread_arena_tls = a;
+#endif
+  return a;
+}
+
+Arena::Arena(int achunk_size)
+    : cur(0), end(0), chunks(0), large(0), spare(0), chunk_size(achunk_size), allocated(0) {}
+
+Arena::~Arena() {
+  reset();
+  release();
+}
+
+ArenaChunk *Arena::new_chunk(int64 s) {
+  int64 n = ARENA_CHUNK_HEADER + s;
+  ArenaChunk *c = (ArenaChunk *)MALLOC(n);
+  c->end = (char *)c + n;
+  allocated += n;
+  return c;
+}
+
+void *Arena::alloc_slow(int64 s) {
+  if (s > chunk_size / 4) {
+    ArenaChunk *c = new_chunk(s);
+    c->next = large;
+    large = c;
+    return c->data();
+  }
+  ArenaChunk *c = spare;
+  if (c)
+    spare = c->next;
+  else
+    c = new_chunk(chunk_size);
+  c->next = chunks;
+  chunks = c;
+  cur = c->data() + s;
+  end = c->end;
+  return c->data();
+}
+
+void Arena::reset(ArenaMark m) {
+  while (large != m.large) {
+    ArenaChunk *c = large;
+    large = c->next;
+    allocated -= c->end - (char *)c;
+    FREE(c);
+  }
+  while (chunks != m.chunk) {
+    ArenaChunk *c = chunks;
+    chunks = c->next;
+    c->next = spare;
+    spare = c;
+  }
+  cur = m.cur;
+  end = chunks ? chunks->end : 0;
+}
+
+void Arena::release() {
+  while (ArenaChunk *c = spare) {
+    spare = c->next;
+    allocated -= c->end - (char *)c;
+    FREE(c);
+  }
+}
+
+#ifdef TEST_LIB
+struct TestArenaData {
+  Vec<int, ArenaAlloc> v;
+  Map<int, int, ArenaAlloc> m;
+  List<int, ArenaAlloc> l;
+};
+
+static void *test_arena_thread(void *data) {
+  ArenaScope s;
+  assert(current_arena() == thread_arena() && current_arena() != (Arena *)data);
+  Vec<int, ArenaAlloc> v;
+  for (int i = 0; i < 1000; i++) v.add(i);
+  assert(v.n == 1000 && v[999] == 999);
+  return 0;
+}
+
+void test_arena() {
+  Arena a(4096);
+  {
+    ArenaScope s(&a);
+    assert(current_arena() == &a);
+    TestArenaData d;
+    for (int i = 0; i < 1000; i++) {
+      d.v.add(i);
+      d.m.put(i, i * 2);
+      d.l.push(i);
+    }
+    for (int i = 0; i < 1000; i++) assert(d.v[i] == i && d.m.get(i) == i * 2);
+    assert(d.l.first() == 999);
+    ArenaChunk *large = a.large;
+    int64 allocated = a.allocated;
+    {  // nested: released at the end, the outer containers stay good
+      ArenaScope n(&a);
+      Vec<char *, ArenaAlloc> w;
+      for (int i = 0; i < 100; i++) w.add((char *)ArenaAlloc::alloc(2000));  // large
+      assert(a.large != large && a.allocated > allocated + 100 * 2000);
+    }
+    assert(a.large == large && a.allocated < allocated + 100 * 2000);
+    for (int i = 0; i < 1000; i++) assert(d.v[i] == i && d.m.get(i) == i * 2);
+    pthread_t t = create_thread(test_arena_thread, &a);
+    pthread_join(t, 0);
+    assert(current_arena() == &a);
+  }
+  assert(!current_arena() && !a.chunks && !a.cur && a.spare);
+  int64 allocated = a.allocated;
+  {  // spare chunks are reused
+    ArenaScope s(&a);
+    for (int i = 0; i < 100; i++) memset(ArenaAlloc::alloc(100), 0, 100);
+  }
+  assert(a.allocated == allocated);
+  a.release();
+  assert(!a.allocated && !a.spare);
+  printf("arena test\tPASSED\n");
+}
+#endif
@@ -0,0 +1,100 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#ifndef _arena_H_
+#define _arena_H_
+
+#define ARENA_CHUNK_SIZE (64 * 1024)  // default, allocations over a quarter of it get their own chunk
+#define ARENA_ALIGNMENT 16
+#define ARENA_CHUNK_HEADER ((sizeof(ArenaChunk) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+/*
+  Region allocator: alloc() bumps a pointer through a chunk and free() does
+  nothing.  Memory is released all at once by reset(), either to a mark()
+  taken earlier or entirely.  Chunks released by a reset are kept for reuse
+  until the arena is destroyed or release()'d.
+
+  ArenaAlloc is an allocator policy for Vec, Map, List etc. which allocates
+  from the thread's current arena, so containers built while a request is
+  being handled need not be freed:
+
+    ArenaScope scope;  // this thread's arena, reset at the end of the scope
+    Vec<int, ArenaAlloc> v;
+    Map<cchar *, int, ArenaAlloc> m;
+
+  A container must not be used (or grow) after its scope ends, nor be
+  passed to another thread which then grows it.
+*/
+
+struct ArenaChunk {
+  ArenaChunk *next;
+  char *end;
+  char *data() { return (char *)this + ARENA_CHUNK_HEADER; }
+};
+
+struct ArenaMark {
+  ArenaChunk *chunk, *large;
+  char *cur;
+};
+
+class Arena {
+ public:
+  char *cur, *end;     // free space in chunks
+  ArenaChunk *chunks;  // in use, the current one first
+  ArenaChunk *large;   // in use, one per large allocation
+  ArenaChunk *spare;   // released for reuse
+  int chunk_size;
+  int64 allocated;  // bytes in chunks, in use or spare
+
+  void *alloc(int64 s) {
+    s = (s + ARENA_ALIGNMENT - 1) & ~(int64)(ARENA_ALIGNMENT - 1);
+    if (end - cur < s) return alloc_slow(s);
+    void *p = cur;
+    cur += s;
+    return p;
+  }
+  void free(void *p) {}
+  ArenaMark mark() { return {chunks, large, cur}; }
+  void reset(ArenaMark m);  // release everything allocated since m
+  void reset() { reset(ArenaMark{0, 0, 0}); }
+  void release();  // free the spare chunks
+  // private
+  void *alloc_slow(int64 s);
+  ArenaChunk *new_chunk(int64 s);
+
+  Arena(int achunk_size = ARENA_CHUNK_SIZE);
+  ~Arena();
+};
+
+#ifdef HAVE_TLS
+extern __thread Arena *current_arena_tls;
+static inline Arena *current_arena() { return current_arena_tls; }
+static inline void set_current_arena(Arena *a) { current_arena_tls = a; }
+#else
+Arena *current_arena();
+void set_current_arena(Arena *a);
+#endif
+Arena *thread_arena();  // this thread's own, freed when it exits
+
+class ArenaAlloc {
+ public:
+  static void *alloc(int s) { return current_arena()->alloc(s); }
+  static void free(void *p) {}
+};
+
+// makes the arena current, and on leaving resets it and restores the previous one
+class ArenaScope {
+ public:
+  Arena *arena, *previous;
+  ArenaMark m;
+
+  ArenaScope(Arena *a = thread_arena()) : arena(a), previous(current_arena()), m(a->mark()) { set_current_arena(a); }
+  ~ArenaScope() {
+    arena->reset(m);
+    set_current_arena(previous);
+  }
+};
+
+void test_arena();
+
+#endif
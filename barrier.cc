@@ -1,65 +1,171 @@
 #include "barrier.h"
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// spin with exponential backoff while *addr == val, charging polls to *budget, returns 1 if it changed
+static int spin_while(volatile uint32_t *addr, uint32_t val, int *budget) {
+  int backoff = 1;
+  while (*budget > 0) {
+    for (int i = 0; i < backoff; i++) cpu_relax();
+    *budget -= backoff;
+    if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) != val) return 1;
+    if (backoff < 64) backoff <<= 1;
+  }
+  return 0;
+}
+
+static void sleep_while(volatile uint32_t *addr, uint32_t val, volatile int32_t *sleepers) {
+  __atomic_fetch_add(sleepers, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(addr, __ATOMIC_SEQ_CST) == val) futex_wait(addr, val);
+  __atomic_fetch_sub(sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void wake(volatile uint32_t *addr, volatile int32_t *sleepers) {
+  if (__atomic_load_n(sleepers, __ATOMIC_SEQ_CST)) futex_wake(addr);
+}
 
 int barrier_init(barrier_t *barrier, int count) {
-  int ret = 0;
+  if (count < 0) return EINVAL;
   barrier->counter = count;
-  if ((ret = pthread_mutex_init(&barrier->mutex, 0)) != 0) return ret;
-  if ((ret = pthread_cond_init(&barrier->cond, 0)) != 0) {
-    pthread_mutex_destroy(&barrier->mutex);
-    return ret;
-  }
+  barrier->phase = 0;
+  barrier->sleepers = 0;
+  barrier->count = count;
+  barrier->spin = BARRIER_SPIN;
   return 0;
 }
 
 int barrier_destroy(barrier_t *barrier) {
-  int ret = 0;
-  if ((ret = pthread_mutex_lock(&barrier->mutex)) != 0) return ret;
-  if (barrier->counter) {
-    pthread_mutex_unlock(&barrier->mutex);
-    return EBUSY;
-  }
-  if ((ret = pthread_mutex_unlock(&barrier->mutex)) != 0) return ret;
-  if ((ret = pthread_mutex_destroy(&barrier->mutex)) != 0) {
-    pthread_cond_destroy(&barrier->cond);
-    return ret;
-  }
-  return pthread_cond_destroy(&barrier->cond);
+  uint32_t c = __atomic_load_n(&barrier->counter, __ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&barrier->sleepers, __ATOMIC_ACQUIRE) || (c && c != (uint32_t)barrier->count)) return EBUSY;
+  return 0;
 }
 
 int barrier_signal(barrier_t *barrier) {
-  int ret = 0;
-  if ((ret = pthread_mutex_lock(&barrier->mutex))) return ret;
-  barrier->counter--;
-  if (barrier->counter == 0)
-    if ((ret = pthread_cond_broadcast(&barrier->cond)) != 0) {
-      pthread_mutex_unlock(&barrier->mutex);
-      return ret;
-    }
-  if ((ret = pthread_mutex_unlock(&barrier->mutex)) != 0) return ret;
-  return ret;
+  if (!__atomic_sub_fetch(&barrier->counter, 1, __ATOMIC_SEQ_CST)) wake(&barrier->counter, &barrier->sleepers);
+  return 0;
 }
 
 int barrier_wait(barrier_t *barrier) {
-  int ret = 0;
-  if ((ret = pthread_mutex_lock(&barrier->mutex))) return ret;
-  while (barrier->counter)
-    if ((ret = pthread_cond_wait(&barrier->cond, &barrier->mutex)) != 0) break;
-  if ((ret = pthread_mutex_unlock(&barrier->mutex)) != 0) return ret;
-  return ret;
+  int budget = barrier->spin;
+  uint32_t c;
+  while ((c = __atomic_load_n(&barrier->counter, __ATOMIC_ACQUIRE))) {
+    if (spin_while(&barrier->counter, c, &budget)) continue;
+    sleep_while(&barrier->counter, c, &barrier->sleepers);
+  }
+  return 0;
 }
 
 int barrier_signal_and_wait(barrier_t *barrier) {
-  int ret = 0;
-  if ((ret = pthread_mutex_lock(&barrier->mutex))) return ret;
-  barrier->counter--;
-  if (barrier->counter == 0)
-    if ((ret = pthread_cond_broadcast(&barrier->cond)) != 0) {
-      pthread_mutex_unlock(&barrier->mutex);
-      return ret;
+  uint32_t phase = __atomic_load_n(&barrier->phase, __ATOMIC_ACQUIRE);
+  if (!__atomic_sub_fetch(&barrier->counter, 1, __ATOMIC_ACQ_REL)) {
+    // last to arrive: rearm for the next phase before releasing anyone into it
+    __atomic_store_n(&barrier->counter, barrier->count, __ATOMIC_RELAXED);
+    __atomic_store_n(&barrier->phase, phase + 1, __ATOMIC_SEQ_CST);
+    wake(&barrier->phase, &barrier->sleepers);
+    return 0;
+  }
+  int budget = barrier->spin;
+  if (!spin_while(&barrier->phase, phase, &budget)) sleep_while(&barrier->phase, phase, &barrier->sleepers);
+  return 0;
+}
+
+int dissemination_barrier_init(dissemination_barrier_t *barrier, int count) {
+  if (count < 1) return EINVAL;
+  int rounds = 0;
+  while ((1 << rounds) < count) rounds++;
+  if (rounds > BARRIER_MAX_ROUNDS) return EINVAL;
+  void *p = 0;
+  if (posix_memalign(&p, alignof(dissemination_barrier_node_t), sizeof(dissemination_barrier_node_t) * count))
+    return ENOMEM;
+  memset(p, 0, sizeof(dissemination_barrier_node_t) * count);
+  barrier->count = count;
+  barrier->rounds = rounds;
+  barrier->spin = BARRIER_SPIN;
+  barrier->node = (dissemination_barrier_node_t *)p;
+  return 0;
+}
+
+int dissemination_barrier_destroy(dissemination_barrier_t *barrier) {
+  for (int i = 0; i < barrier->count; i++)
+    if (__atomic_load_n(&barrier->node[i].sleeping, __ATOMIC_ACQUIRE)) return EBUSY;
+  free(barrier->node);
+  barrier->node = 0;
+  return 0;
+}
+
+// flags count signals so a partner already in the next episode can't be confused with this one
+int dissemination_barrier_wait(dissemination_barrier_t *barrier, int id) {
+  dissemination_barrier_node_t *me = &barrier->node[id];
+  uint32_t episode = ++me->episode;
+  int budget = barrier->spin;
+  for (int r = 0; r < barrier->rounds; r++) {
+    dissemination_barrier_node_t *partner = &barrier->node[(id + (1 << r)) % barrier->count];
+    __atomic_fetch_add(&partner->flag[r], 1, __ATOMIC_SEQ_CST);
+    wake(&partner->flag[r], &partner->sleeping);
+    uint32_t f;
+    while ((int32_t)((f = __atomic_load_n(&me->flag[r], __ATOMIC_ACQUIRE)) - episode) < 0) {
+      if (spin_while(&me->flag[r], f, &budget)) continue;
+      __atomic_store_n(&me->sleeping, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&me->flag[r], __ATOMIC_SEQ_CST) == f) futex_wait(&me->flag[r], f);
+      __atomic_store_n(&me->sleeping, 0, __ATOMIC_SEQ_CST);
     }
-  while (barrier->counter)
-    if ((ret = pthread_cond_wait(&barrier->cond, &barrier->mutex)) != 0) break;
-  if ((ret = pthread_mutex_unlock(&barrier->mutex)) != 0) return ret;
-  return ret;
+  }
+  return 0;
+}
+
+#ifdef TEST_LIB
+#define TEST_BARRIER_THREADS 5
+#define TEST_BARRIER_PHASES 200
+
+static barrier_t test_barrier_shared, test_barrier_done;
+static dissemination_barrier_t test_barrier_dissemination;
+static volatile int test_barrier_count = 0;
+
+static void *test_barrier_thread(void *data) {
+  int id = (int)(intptr_t)data;
+  for (int p = 0; p < TEST_BARRIER_PHASES; p++) {
+    __atomic_fetch_add(&test_barrier_count, 1, __ATOMIC_SEQ_CST);
+    if (p & 1)
+      dissemination_barrier_wait(&test_barrier_dissemination, id);
+    else
+      barrier_signal_and_wait(&test_barrier_shared);
+    assert(__atomic_load_n(&test_barrier_count, __ATOMIC_SEQ_CST) == (p + 1) * TEST_BARRIER_THREADS);
+    if (p & 1)
+      barrier_signal_and_wait(&test_barrier_shared);
+    else
+      dissemination_barrier_wait(&test_barrier_dissemination, id);
+  }
+  barrier_signal(&test_barrier_done);
+  return 0;
+}
+
+void test_barrier() {
+  for (int spin = 0; spin < 2; spin++) {
+    test_barrier_count = 0;
+    barrier_init(&test_barrier_shared, TEST_BARRIER_THREADS);
+    barrier_init(&test_barrier_done, TEST_BARRIER_THREADS);
+    dissemination_barrier_init(&test_barrier_dissemination, TEST_BARRIER_THREADS);
+    if (!spin) test_barrier_shared.spin = test_barrier_done.spin = test_barrier_dissemination.spin = 0;
+    pthread_t t[TEST_BARRIER_THREADS];
+    for (int i = 0; i < TEST_BARRIER_THREADS; i++) pthread_create(&t[i], 0, test_barrier_thread, (void *)(intptr_t)i);
+    barrier_wait(&test_barrier_done);
+    for (int i = 0; i < TEST_BARRIER_THREADS; i++) pthread_join(t[i], 0);
+    assert(test_barrier_count == TEST_BARRIER_PHASES * TEST_BARRIER_THREADS);
+    assert(!barrier_destroy(&test_barrier_shared));
+    assert(!barrier_destroy(&test_barrier_done));
+    assert(!dissemination_barrier_destroy(&test_barrier_dissemination));
+  }
+  printf("barrier test\tPASSED\n");
 }
+#endif
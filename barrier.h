@@ -5,15 +5,30 @@
 #define barrier_H
 
 #include <pthread.h>
+#include "futex.h"
 
+#define BARRIER_SPIN 2000      // default polls before sleeping
+#define BARRIER_MAX_ROUNDS 16  // dissemination barrier, up to 2^16 threads
+
+/*
+  Waiters spin with exponential backoff for up to spin polls before sleeping
+  on a futex; set spin after barrier_init() to tune (0 to always sleep).
+
+  barrier_signal()/barrier_wait() are one shot: workers signal and the master
+  waits for count signals, barrier_init() rearms.  barrier_signal_and_wait()
+  is a reusable sense-reversing barrier for count threads.  Don't mix the two
+  on one barrier.
+*/
 struct barrier_t {
-  pthread_mutex_t mutex;
-  pthread_cond_t cond;
-  int counter;
+  volatile uint32_t counter;  // arrivals remaining in this phase
+  volatile uint32_t phase;    // sense, flipped when the last thread arrives
+  volatile int32_t sleepers;
+  int count;
+  int spin;
 };
 
 #define BARRIER_INITIALIZER \
-  { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 }
+  { 0, 0, 0, 0, BARRIER_SPIN }
 
 extern int barrier_init(barrier_t *barrier, int count);
 extern int barrier_destroy(barrier_t *barrier);
@@ -21,4 +36,29 @@ extern int barrier_signal(barrier_t *barrier);           // worker signals
 extern int barrier_wait(barrier_t *barrier);             // master waits
 extern int barrier_signal_and_wait(barrier_t *barrier);  // cooperative barrier
 
+/*
+  Dissemination barrier for high thread counts: in round r thread id signals
+  thread (id + 2^r) % count and waits for thread (id - 2^r) % count, so each
+  thread touches only its own and one other cache line per round and all
+  threads are released after log2(count) rounds without a shared counter.
+  Each thread calls with its own id in [0, count).
+*/
+struct dissemination_barrier_node_t {
+  alignas(64) volatile uint32_t flag[BARRIER_MAX_ROUNDS];  // signals received, per round
+  volatile int32_t sleeping;
+  uint32_t episode;  // completed waits, owner only
+};
+
+struct dissemination_barrier_t {
+  int count, rounds;
+  int spin;
+  dissemination_barrier_node_t *node;
+};
+
+extern int dissemination_barrier_init(dissemination_barrier_t *barrier, int count);
+extern int dissemination_barrier_destroy(dissemination_barrier_t *barrier);
+extern int dissemination_barrier_wait(dissemination_barrier_t *barrier, int id);
+
+void test_barrier();
+
 #endif
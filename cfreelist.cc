@@ -0,0 +1,313 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#include "plib.h"
+
+#ifdef HAVE_TLS
+__thread FreeListCaches freelist_caches;
+#endif
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ConcurrentFreeList *registry[FREELIST_MAX_CACHED];  // by id
+static uint64 registry_gen = 0;
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+
+class FreeListService : public Service {
+ public:
+  int trim_interval;
+  pthread_t trim_thread;
+  void reinit();
+  void start();
+  void stop();
+  FreeListService() : trim_interval(DEFAULT_FREELIST_TRIM_INTERVAL), trim_thread(0) {}
+} freelist_service;
+
+// not collected: a thread's magazines are only referenced from thread local storage
+static FreeListMagazine *new_magazine() {
+  FreeListMagazine *m = (FreeListMagazine *)::malloc(sizeof(FreeListMagazine));
+  m->n = 0;
+  return m;
+}
+
+// return an exiting thread's magazines to the depots of lists which still exist
+static void freelist_thread_exit(void *) {
+#ifdef HAVE_TLS
+  pthread_mutex_lock(&registry_mutex);
+  for (int i = 0; i < FREELIST_MAX_CACHED; i++) {
+    FreeListCache *c = &freelist_caches.c[i];
+    ConcurrentFreeList *l = registry[i];
+    FreeListMagazine *m[2] = {c->loaded, c->previous};
+    for (int j = 0; j < 2; j++) {
+      if (!m[j]) continue;
+      if (!l || l->gen != c->gen)
+        ::free(m[j]);
+      else if (m[j]->n)
+        l->put_full(m[j]);
+      else
+        l->put_empty(m[j]);
+    }
+    c->loaded = c->previous = 0;
+    c->gen = 0;
+  }
+  pthread_mutex_unlock(&registry_mutex);
+#endif
+}
+
+static void make_exit_key() { pthread_key_create(&exit_key, freelist_thread_exit); }
+
+ConcurrentFreeList::ConcurrentFreeList(int asize, int acount, int aalignment)
+    : id(-1), gen(0), full(FREELIST_DEPOT), empty(FREELIST_DEPOT), list(asize, acount, aalignment) {
+  pthread_mutex_init(&mutex, 0);
+  pthread_mutex_lock(&registry_mutex);
+  for (int i = 0; i < FREELIST_MAX_CACHED; i++)
+    if (!registry[i]) {
+      registry[i] = this;
+      id = i;
+      break;
+    }
+  gen = ++registry_gen;
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+ConcurrentFreeList::~ConcurrentFreeList() {
+  pthread_mutex_lock(&registry_mutex);
+  if (id >= 0) registry[id] = 0;
+  pthread_mutex_unlock(&registry_mutex);
+  FreeListMagazine *m;
+  while (full.pop(m)) ::free(m);
+  while (empty.pop(m)) ::free(m);
+  pthread_mutex_destroy(&mutex);
+}
+
+// first use by this thread, c may hold the magazines of a list since destroyed
+FreeListCache *ConcurrentFreeList::attach(FreeListCache *c) {
+  pthread_once(&exit_key_once, make_exit_key);
+  pthread_setspecific(exit_key, (void *)1);
+  ::free(c->loaded);
+  ::free(c->previous);
+  c->loaded = c->previous = 0;
+  c->gen = gen;
+  return c;
+}
+
+FreeListMagazine *ConcurrentFreeList::get_full() {
+  FreeListMagazine *m;
+  return full.pop(m) ? m : 0;
+}
+
+FreeListMagazine *ConcurrentFreeList::get_empty() {
+  FreeListMagazine *m;
+  return empty.pop(m) ? m : new_magazine();
+}
+
+void ConcurrentFreeList::put_full(FreeListMagazine *m) {
+  if (full.push(m)) return;
+  pthread_mutex_lock(&mutex);  // the depot is full
+  while (m->n) list.free(m->v[--m->n]);
+  pthread_mutex_unlock(&mutex);
+  put_empty(m);
+}
+
+void ConcurrentFreeList::put_empty(FreeListMagazine *m) {
+  if (!empty.push(m)) ::free(m);
+}
+
+// loaded is empty
+void *ConcurrentFreeList::alloc_slow(FreeListCache *c) {
+  if (!c) {
+    pthread_mutex_lock(&mutex);
+    void *p = list.alloc();
+    pthread_mutex_unlock(&mutex);
+    return p;
+  }
+  if (c->previous && c->previous->n) {
+    FreeListMagazine *t = c->loaded;
+    c->loaded = c->previous;
+    c->previous = t;
+  } else if (FreeListMagazine *m = get_full()) {
+    if (c->previous) put_empty(c->previous);
+    c->previous = c->loaded;
+    c->loaded = m;
+  } else {
+    if (!c->loaded) c->loaded = new_magazine();
+    FreeListMagazine *l = c->loaded;
+    pthread_mutex_lock(&mutex);
+    while (l->n < FREELIST_MAGAZINE) l->v[l->n++] = list.alloc();
+    pthread_mutex_unlock(&mutex);
+  }
+  return c->loaded->v[--c->loaded->n];
+}
+
+// loaded is full
+void ConcurrentFreeList::free_slow(FreeListCache *c, void *p) {
+  if (!c) {
+    pthread_mutex_lock(&mutex);
+    list.free(p);
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+  if (c->previous && c->previous->n < FREELIST_MAGAZINE) {
+    FreeListMagazine *t = c->loaded;
+    c->loaded = c->previous;
+    c->previous = t;
+  } else {
+    if (c->previous) put_full(c->previous);
+    c->previous = c->loaded;
+    c->loaded = get_empty();
+  }
+  c->loaded->v[c->loaded->n++] = p;
+}
+
+int64 ConcurrentFreeList::trim() {
+  FreeListMagazine *m;
+  pthread_mutex_lock(&mutex);
+  while (full.pop(m)) {
+    while (m->n) list.free(m->v[--m->n]);
+    put_empty(m);
+  }
+  int64 r = list.trim();
+  pthread_mutex_unlock(&mutex);
+  return r;
+}
+
+static void *freelist_trim_main(void *) {
+  while (1) {
+    sleep(freelist_service.trim_interval);
+    int64 released = 0;
+    pthread_mutex_lock(&registry_mutex);
+    for (int i = 0; i < FREELIST_MAX_CACHED; i++)
+      if (registry[i]) released += registry[i]->trim();
+    pthread_mutex_unlock(&registry_mutex);
+#ifdef __GLIBC__
+    if (released) malloc_trim(0);  // give the pages back to the system
+#endif
+  }
+  return 0;
+}
+
+void FreeListService::reinit() { int_config(GET_CONFIG, &trim_interval, DEFAULT_FREELIST_TRIM_INTERVAL, "freelist", "trim_interval"); }
+
+void FreeListService::start() {
+  if (trim_interval > 0) trim_thread = create_thread(freelist_trim_main, 0);
+}
+
+void FreeListService::stop() {
+  if (trim_thread) pthread_cancel(trim_thread);
+  trim_thread = 0;
+}
+
+#ifdef TEST_LIB
+#define TEST_CFREELIST_THREADS 4
+#define TEST_CFREELIST_OBJECTS 5000
+
+struct TestCFreeListObj {
+  int64 owner, serial;
+};
+
+static ConcurrentClassFreeList<TestCFreeListObj> *test_cfreelist_list;
+static MPMCQueue<TestCFreeListObj *> *test_cfreelist_handoff;
+
+static void *test_cfreelist_thread(void *data) {
+  int64 me = (int64)(intptr_t)data;
+  TestCFreeListObj **objs = (TestCFreeListObj **)MALLOC(sizeof(TestCFreeListObj *) * TEST_CFREELIST_OBJECTS);
+  for (int round = 0; round < 10; round++) {
+    for (int i = 0; i < TEST_CFREELIST_OBJECTS; i++) {
+      objs[i] = test_cfreelist_list->alloc();
+      objs[i]->owner = me;
+      objs[i]->serial = i;
+    }
+    for (int i = 0; i < TEST_CFREELIST_OBJECTS; i++) {
+      assert(objs[i]->owner == me && objs[i]->serial == i);  // not handed out twice
+      if (i & 1) {  // freed by another thread
+        while (!test_cfreelist_handoff->push(objs[i])) {
+          TestCFreeListObj *o;
+          if (test_cfreelist_handoff->pop(o)) test_cfreelist_list->free(o);
+        }
+      } else
+        test_cfreelist_list->free(objs[i]);
+    }
+    TestCFreeListObj *o;
+    while (test_cfreelist_handoff->pop(o)) test_cfreelist_list->free(o);
+  }
+  FREE(objs);
+  return 0;
+}
+
+static void test_freelist_trim() {
+  FreeList l(sizeof(int64), 16);
+  void *p[1000];
+  for (int i = 0; i < 1000; i++) p[i] = l.alloc();
+  int block = l.allocated / (1000 / 16 + 1);
+  for (int i = 0; i < 1000; i++)
+    if (i != 500) l.free(p[i]);
+  assert(l.trim() == (int64)block * (1000 / 16 - 1) && l.allocated == 2 * block);  // retained and in use
+  assert(!l.trim());
+  for (int i = 0; i < 32; i++) p[i] = l.alloc();  // from the remaining blocks, then a new one
+  assert(p[0] != p[1] && l.allocated == 3 * block);
+  for (int i = 0; i < 32; i++) l.free(p[i]);
+  l.free(p[500]);
+  l.retain = 0;
+  assert(l.trim() == 3 * block && !l.allocated && !l.head && !l.block_head);
+}
+
+static int test_object_live = 0;
+
+struct TestObject {  // move-only, counts live objects
+  int64 *v;
+  int n;
+  TestObject(int an) : v((int64 *)MALLOC(sizeof(int64) * an)), n(an) {
+    for (int i = 0; i < n; i++) v[i] = i;
+    test_object_live++;
+  }
+  TestObject(TestObject &&o) : v(o.v), n(o.n) {
+    o.v = 0;
+    test_object_live++;
+  }
+  TestObject(const TestObject &) = delete;
+  ~TestObject() {
+    if (v) FREE(v);
+    test_object_live--;
+  }
+};
+
+static void test_object_freelist() {
+  ObjectFreeList<TestObject> l;
+  TestObject *a = l.alloc(10), *b = l.alloc(std::move(*a));
+  assert(!a->v && b->n == 10 && b->v[9] == 9 && test_object_live == 2);
+  l.free(a);
+  l.free(b);
+  assert(!test_object_live && !l.active);
+  ConcurrentObjectFreeList<TestObject> cl;
+  TestObject *c = cl.alloc(3);
+  assert(c->v[2] == 2 && test_object_live == 1);
+  cl.free(c);
+  assert(!test_object_live);
+}
+
+void test_cfreelist() {
+  test_freelist_trim();
+  test_object_freelist();
+  test_cfreelist_list = new ConcurrentClassFreeList<TestCFreeListObj>;
+  test_cfreelist_handoff = new MPMCQueue<TestCFreeListObj *>(256);
+  pthread_t t[TEST_CFREELIST_THREADS];
+  for (int i = 0; i < TEST_CFREELIST_THREADS; i++) t[i] = create_thread(test_cfreelist_thread, (void *)(intptr_t)i);
+  for (int i = 0; i < TEST_CFREELIST_THREADS; i++) pthread_join(t[i], 0);
+  // objects are recycled across threads rather than each thread growing the list
+  int most = 2 * TEST_CFREELIST_THREADS * TEST_CFREELIST_OBJECTS * test_cfreelist_list->list.size;
+  assert(test_cfreelist_list->list.allocated < most);
+  // the exited threads' magazines went back to the depot
+  TestCFreeListObj *o = test_cfreelist_list->alloc();
+  assert(o && test_cfreelist_list->full.size() > 0);
+  test_cfreelist_list->free(o);
+  // the depot and all but one of the free blocks go back to malloc, this thread's magazines stay
+  int before = test_cfreelist_list->list.allocated;
+  assert(test_cfreelist_list->trim() > 0 && !test_cfreelist_list->full.size());
+  int block = test_cfreelist_list->list.size * test_cfreelist_list->list.count + sizeof(void *);
+  assert(test_cfreelist_list->list.allocated < before);
+  assert(test_cfreelist_list->list.allocated <= (1 + 2 * FREELIST_MAGAZINE) * block);
+  delete test_cfreelist_handoff;
+  delete test_cfreelist_list;
+  printf("cfreelist test\tPASSED\n");
+}
+#endif
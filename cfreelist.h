@@ -0,0 +1,134 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#ifndef _cfreelist_H_
+#define _cfreelist_H_
+
+#define FREELIST_MAGAZINE 32    // objects in a magazine, moved between a thread and the depot at once
+#define FREELIST_DEPOT 1024     // magazines in each depot queue, beyond that objects go back to the FreeList
+#define FREELIST_MAX_CACHED 64  // ConcurrentFreeLists with thread caches, the rest go to the FreeList
+#define DEFAULT_FREELIST_TRIM_INTERVAL 60  // seconds between background trims, 0 for none
+
+/*
+  FreeList for any number of threads (magazines and depot, after Bonwick's
+  vmem).  Each thread caches objects of each list in two magazines, so
+  alloc() and free() are a load or store into a thread local array until a
+  magazine runs empty or full.  Then whole magazines are exchanged with the
+  list's depot, which is a pair of lock-free queues of full and empty
+  magazines, so an object freed on one thread is reused by another.  Only
+  when the depot has no full magazine (or no room for one) does a thread
+  take the mutex to fill one from (or empty one into) the underlying
+  FreeList.
+
+  A thread's magazines go back to the depot when it exits.  The number of
+  lists with thread caches is limited to FREELIST_MAX_CACHED; the others
+  (and all without thread local storage) use the FreeList under the mutex.
+
+  trim() empties the depot's full magazines into the FreeList and releases
+  its free blocks beyond list.retain.  A service trims every list each
+  "freelist.trim_interval" seconds.
+*/
+
+struct FreeListMagazine {
+  int n;
+  void *v[FREELIST_MAGAZINE];
+};
+
+struct FreeListCache {  // per thread, per list
+  uint64 gen;           // of the list it caches, stale if it doesn't match
+  FreeListMagazine *loaded, *previous;
+};
+
+struct FreeListCaches {
+  FreeListCache c[FREELIST_MAX_CACHED];
+};
+#ifdef HAVE_TLS
+extern __thread FreeListCaches freelist_caches;
+#endif
+
+class ConcurrentFreeList {
+ public:
+  int id;  // thread cache slot, -1 for none
+  uint64 gen;
+  MPMCQueue<FreeListMagazine *> full, empty;
+  pthread_mutex_t mutex;
+  FreeList list;  // under mutex
+
+  void *alloc() {
+#ifndef VALGRIND_TEST
+    FreeListCache *c = cache();
+    if (c && c->loaded && c->loaded->n) return c->loaded->v[--c->loaded->n];
+    return alloc_slow(c);
+#else
+    return MALLOC(list.size);
+#endif
+  }
+  void free(void *p) {
+#ifndef VALGRIND_TEST
+    FreeListCache *c = cache();
+    if (c && c->loaded && c->loaded->n < FREELIST_MAGAZINE) {
+      c->loaded->v[c->loaded->n++] = p;
+      return;
+    }
+    free_slow(c, p);
+#else
+    FREE(p);
+#endif
+  }
+  int64 trim();  // returns the bytes released
+  FreeListCache *cache() {
+#ifdef HAVE_TLS
+    if (id < 0) return 0;
+    FreeListCache *c = &freelist_caches.c[id];
+    return c->gen == gen ? c : attach(c);
+#else
+    return 0;
+#endif
+  }
+  // private
+  FreeListCache *attach(FreeListCache *c);
+  void *alloc_slow(FreeListCache *c);
+  void free_slow(FreeListCache *c, void *p);
+  FreeListMagazine *get_full();
+  FreeListMagazine *get_empty();
+  void put_full(FreeListMagazine *m);
+  void put_empty(FreeListMagazine *m);
+
+  ConcurrentFreeList(int asize, int acount = 64, int aalignment = 16);
+  ~ConcurrentFreeList();
+};
+
+template <class C>
+class ConcurrentClassFreeList : public ConcurrentFreeList {
+ public:
+  C protoObject;
+
+  C *alloc() {
+    C *o = (C *)ConcurrentFreeList::alloc();
+    memcpy((void *)o, (void *)&protoObject, sizeof(protoObject));
+    return o;
+  }
+
+  ConcurrentClassFreeList(int acount = 64, int aalignment = 16)
+      : ConcurrentFreeList(sizeof(C), acount, aalignment) {}
+};
+
+template <class C>
+class ConcurrentObjectFreeList : public ConcurrentFreeList {
+ public:
+  template <class... Args>
+  C *alloc(Args &&...args) {
+    return new (ConcurrentFreeList::alloc()) C(std::forward<Args>(args)...);
+  }
+  void free(C *o) {
+    o->~C();
+    ConcurrentFreeList::free(o);
+  }
+
+  ConcurrentObjectFreeList(int acount = 64, int aalignment = 16)
+      : ConcurrentFreeList(sizeof(C), acount, aalignment > (int)alignof(C) ? aalignment : (int)alignof(C)) {}
+};
+
+void test_cfreelist();
+
+#endif
@@ -4,45 +4,227 @@
 #include "plib.h"
 
 #include "conn.h"
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-static pthread_mutex_t date_mutex = PTHREAD_MUTEX_INITIALIZER;
-static time_t date_time = 0;
-static char date_string[128] = "";
-static int date_string_len = 0;
+IOBufferPool iobuf_pool;
+static ConcurrentClassFreeList<buffer_t> segment_freelist;
+
+// the date for each second is formatted once, by the first caller to see it, and published for lock-free copying
+#define DATE_SLOTS 4  // published dates in use, a copy can be this many seconds slow before it could tear
+struct DateString {
+  time_t time;
+  int len;
+  char s[CONN_DATE_SIZE];
+};
+static DateString date_strings[DATE_SLOTS];
+static DateString *date_current = &date_strings[0];
+static time_t date_claimed = 0;  // the second being formatted
+static uint32 date_next = 1;     // slot counter, date_strings[0] is the unset initial date
 static cchar *const weekdays[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
 static cchar *const months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
 
 Conn::Conn() {
+  priority = THREAD_POOL_INTERACTIVE;  // never behind background work sharing the pool
   ifd = ofd = -1;
   factory = 0;
-  rbuf.buf = rbuf.cur = rbuf.end = rbuf.bufend = 0;
+  reactor = 0;
+  rbuf.buf = rbuf.cur = rbuf.end = rbuf.bufend = rbuf.scan = 0;
   rbuf.next = 0;
+  rbuf.flags = 0;
   wbuf.buf = wbuf.cur = wbuf.end = wbuf.bufend = 0;
   wbuf.next = 0;
+  wbuf.flags = 0;
+  rbuf_size = wbuf_size = 0;
+  iov = 0;
+  iov_size = 0;
+  pipefd[0] = pipefd[1] = -1;
+  piped = 0;
+  uring_flags = 0;
+  uring_recv = 0;
+  wqueued = 0;
+  write_high = write_low = 0;
+  throttled = 0;
+}
+
+void Conn::init(int arbuf_size, int awbuf_size) {
+  rbuf_size = arbuf_size;
+  wbuf_size = awbuf_size;
+  alloc_buffers();
+}
+
+IOBufferPool::IOBufferPool() {
+  for (int i = 0; i < IOBUF_CLASSES; i++) {
+    pthread_mutex_init(&classes[i].mutex, 0);
+    classes[i].free = 0;  // allocated on first use
+    classes[i].count = 0;
+    classes[i].max = IOBUF_POOL_CACHED / class_size(i);
+  }
 }
 
-void Conn::init(int rbuf_size, int wbuf_size) {
-  rbuf.buf = (byte *)MALLOC(rbuf_size);
-  rbuf.end = rbuf.cur = rbuf.buf;
-  rbuf.bufend = rbuf.buf + rbuf_size;
-  wbuf.buf = (byte *)MALLOC(wbuf_size);
-  wbuf.end = wbuf.cur = wbuf.buf;
-  wbuf.bufend = wbuf.buf + wbuf_size;
+byte *IOBufferPool::alloc(int &size) {
+  int c = size_class(size);
+  if (c < 0) return (byte *)MALLOC_ATOMIC(size);
+  size = class_size(c);
+  Class &k = classes[c];
+  byte *b = 0;
+  pthread_mutex_lock(&k.mutex);
+  if (k.count) b = k.free[--k.count];
+  pthread_mutex_unlock(&k.mutex);
+  return b ? b : (byte *)MALLOC_ATOMIC(size);
+}
+
+void IOBufferPool::free(byte *b, int size) {
+  int c = size_class(size);
+  if (c >= 0 && class_size(c) == size) {
+    Class &k = classes[c];
+    pthread_mutex_lock(&k.mutex);
+    if (!k.free) k.free = (byte **)MALLOC(sizeof(byte *) * k.max);
+    if (k.count < k.max) {
+      k.free[k.count++] = b;
+      b = 0;
+    }
+    pthread_mutex_unlock(&k.mutex);
+  }
+  if (b) FREE(b);
+}
+
+byte *Conn::alloc_iobuf(int &size) { return reactor ? reactor->alloc_buffer(size) : iobuf_pool.alloc(size); }
+
+void Conn::free_iobuf(byte *b, int size) {
+  if (reactor)
+    reactor->free_buffer(b, size);
+  else
+    iobuf_pool.free(b, size);
+}
+
+void Conn::alloc_buffers() {
+  if (!rbuf.buf) {
+    int size = rbuf_size < IOBUF_SMALL ? rbuf_size : IOBUF_SMALL;
+    rbuf.buf = alloc_iobuf(size);
+    rbuf.end = rbuf.cur = rbuf.line = rbuf.scan = rbuf.buf;
+    rbuf.bufend = rbuf.buf + size;
+  }
+  if (!wbuf.buf) {
+    int size = wbuf_size < IOBUF_SMALL ? wbuf_size : IOBUF_SMALL;
+    wbuf.buf = alloc_iobuf(size);
+    wbuf.end = wbuf.cur = wbuf.buf;
+    wbuf.bufend = wbuf.buf + size;
+  }
+}
+
+void Conn::release_buffers() {
+  if (rbuf.buf && rbuf.cur == rbuf.end && !(uring_flags & CONN_URING_READ)) {
+    free_iobuf(rbuf.buf, rbuf.bufend - rbuf.buf);
+    rbuf.buf = rbuf.cur = rbuf.end = rbuf.bufend = rbuf.line = rbuf.scan = 0;
+  }
+  if (wbuf.buf && wbuf.cur == wbuf.end && !wbuf.next && !(uring_flags & CONN_URING_WRITE)) {
+    free_iobuf(wbuf.buf, wbuf.bufend - wbuf.buf);
+    wbuf.buf = wbuf.cur = wbuf.end = wbuf.bufend = 0;
+  }
+}
+
+int Conn::make_room() {
+  int used = rbuf.end - rbuf.cur, size = rbuf.bufend - rbuf.buf;
+  if (used > size / 2 && size < rbuf_size) {
+    int nsize = size * 2 < rbuf_size ? size * 2 : rbuf_size;
+    byte *b = alloc_iobuf(nsize);
+    memcpy(b, rbuf.cur, used);
+    free_iobuf(rbuf.buf, size);
+    rbuf.scan = b + (rbuf.scan > rbuf.cur ? rbuf.scan - rbuf.cur : 0);
+    rbuf.buf = rbuf.cur = rbuf.line = b;
+    rbuf.end = b + used;
+    rbuf.bufend = b + nsize;
+    return 0;
+  }
+  if (rbuf.cur == rbuf.buf) return -1;
+  check_rbuf();
+  return 0;
+}
+
+#if defined(__AVX2__)
+#define SCAN_WIDTH 32
+static inline uint32 scan_mask(const byte *p) {  // bit i set if p[i] is '\n'
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), _mm256_set1_epi8('\n')));
+}
+#elif defined(__SSE2__)
+#define SCAN_WIDTH 16
+static inline uint32 scan_mask(const byte *p) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), _mm_set1_epi8('\n')));
+}
+#endif
+
+byte *scan_line(byte *p, byte *e) {
+#ifdef SCAN_WIDTH
+  for (; e - p >= SCAN_WIDTH; p += SCAN_WIDTH) {
+    uint32 m = scan_mask(p);
+    if (m) return p + __builtin_ctz(m);
+  }
+#endif
+  return p < e ? (byte *)memchr(p, '\n', e - p) : 0;
+}
+
+int scan_lines(byte *p, byte *e, int *nl, int max) {
+  byte *s = p;
+  int n = 0;
+#ifdef SCAN_WIDTH
+  for (; e - p >= SCAN_WIDTH && n < max; p += SCAN_WIDTH)
+    for (uint32 m = scan_mask(p); m && n < max; m &= m - 1) nl[n++] = p - s + __builtin_ctz(m);
+#endif
+  for (; p < e && n < max; p++)
+    if (*p == '\n') nl[n++] = p - s;
+  return n;
+}
+
+int HeaderIndex::add(byte *b, int start, int end) {
+  if (end > start && b[end - 1] == '\r') end--;
+  byte *c = (byte *)memchr(b + start, ':', end - start);
+  if (!c || c == b + start || n >= CONN_MAX_HEADERS) return -1;
+  header_t &x = h[n++];
+  x.name = start;
+  x.name_len = c - (b + start);
+  x.value = c + 1 - b;
+  while (x.value < end && (b[x.value] == ' ' || b[x.value] == '\t')) x.value++;
+  while (end > x.value && (b[end - 1] == ' ' || b[end - 1] == '\t')) end--;
+  x.value_len = end - x.value;
+  return 0;
+}
+
+int HeaderIndex::find(cchar *aname, int len) {
+  for (int i = 0; i < n; i++)
+    if (h[i].name_len == len && !strncasecmp((char *)base + h[i].name, aname, len)) return i;
+  return -1;
 }
 
 int Conn::get_line() {
-  byte *p = rbuf.cur, *x = 0;
+  if (throttled && put()) return -1;
   while (1) {
-    int lcur = rbuf.end - p;
-    if (lcur && (x = (byte *)memchr((char *)p, '\n', lcur))) {
+    byte *x;
+    if ((x = next_line())) {
       rbuf.line = rbuf.cur;
       rbuf.cur = x + 1;
       return 0;
     }
-    p = rbuf.end;
-    int lend = rbuf.bufend - rbuf.end;
-    if (lend <= 0) return -1;
-    int r = read(ifd, rbuf.end, lend);
+    if (rbuf.cur == rbuf.end) {  // waiting for the next request, keep only a small buffer meanwhile
+      if (rbuf.bufend - rbuf.buf > IOBUF_SMALL) {
+        free_iobuf(rbuf.buf, rbuf.bufend - rbuf.buf);
+        rbuf.buf = 0;
+        alloc_buffers();
+      } else
+        rbuf.reset();
+    }
+    if (rbuf.end == rbuf.bufend && make_room() < 0) return -1;
+    int r = read(ifd, rbuf.end, rbuf.bufend - rbuf.end);
     if (r <= 0) {
       switch (errno) {
         case EINTR:
@@ -55,13 +237,42 @@ int Conn::get_line() {
   }
 }
 
+int Conn::get_headers(HeaderIndex &h) {
+  while (1) {
+    int r = scan_headers(h);
+    if (r) return r < 0 ? -1 : 0;
+    if (get_some() < 0) return -1;
+  }
+}
+
+int Conn::scan_headers(HeaderIndex &h) {
+  int nl[CONN_MAX_HEADERS];
+  while (1) {
+    int n = scan_lines(rbuf.cur + h.scanned, rbuf.end, nl, CONN_MAX_HEADERS);
+    for (int i = 0; i < n; i++) {
+      int end = h.scanned + nl[i], start = h.line;
+      h.line = end + 1;
+      if (end == start || (end == start + 1 && rbuf.cur[start] == '\r')) {
+        h.base = rbuf.line = rbuf.cur;
+        rbuf.cur += h.line;
+        h.line = h.scanned = 0;
+        return 1;
+      }
+      if (h.add(rbuf.cur, start, end) < 0) return -1;
+    }
+    if (n < CONN_MAX_HEADERS) break;
+    h.scanned += nl[n - 1] + 1;
+  }
+  h.scanned = rbuf.end - rbuf.cur;
+  return 0;
+}
+
 int Conn::get(int n) {
   while (1) {
     int lcur = rbuf.end - rbuf.cur;
     if (lcur >= n) return 0;
-    int lend = rbuf.bufend - rbuf.end;
-    if (lend <= 0) return -1;
-    int r = read(ifd, rbuf.end, lend);
+    if (rbuf.end == rbuf.bufend && make_room() < 0) return -1;
+    int r = read(ifd, rbuf.end, rbuf.bufend - rbuf.end);
     if (r <= 0) {
       switch (errno) {
         case EINTR:
@@ -76,9 +287,8 @@ int Conn::get(int n) {
 
 int Conn::get_some() {
 Lagain:
-  int lend = rbuf.bufend - rbuf.end;
-  if (lend <= 0) return -1;
-  int r = read(ifd, rbuf.end, lend);
+  if (rbuf.end == rbuf.bufend && make_room() < 0) return -1;
+  int r = read(ifd, rbuf.end, rbuf.bufend - rbuf.end);
   if (r <= 0) {
     switch (errno) {
       case EINTR:
@@ -91,6 +301,79 @@ Lagain:
   return 0;
 }
 
+int Conn::read_some() {
+  if (reactor && reactor->completions) return reactor->read_some(this);
+  while (1) {
+    if (rbuf.end == rbuf.bufend && make_room() < 0) return -1;
+    int r = read(ifd, rbuf.end, rbuf.bufend - rbuf.end);
+    if (r > 0) {
+      rbuf.end += r;
+      return r;
+    }
+    if (!r) return -1;
+    switch (errno) {
+      case EINTR:
+        continue;
+      case EAGAIN:
+        return 0;
+      default:
+        return -1;
+    }
+  }
+}
+
+int Conn::try_get_line() {
+  if (throttled) return 0;
+  while (1) {
+    byte *x;
+    if ((x = next_line())) {
+      rbuf.line = rbuf.cur;
+      rbuf.cur = x + 1;
+      return 1;
+    }
+    int r = read_some();
+    if (r <= 0) return r;
+  }
+}
+
+int Conn::try_get_headers(HeaderIndex &h) {
+  if (throttled) return 0;
+  while (1) {
+    int r = scan_headers(h);
+    if (r) return r;
+    if ((r = read_some()) <= 0) return r;
+  }
+}
+
+int Conn::try_get(int n) {
+  if (throttled) return 0;
+  while (rbuf.end - rbuf.cur < n) {
+    int r = read_some();
+    if (r <= 0) return r;
+  }
+  return 1;
+}
+
+int Conn::flush() {
+  if (reactor && reactor->completions) return reactor->flush(this);
+  while (1) {
+    int r = write_some();
+    if (r > 0) continue;
+    if (!r) break;
+    switch (errno) {
+      case EINTR:
+        continue;
+      case EAGAIN:
+        return 1;
+      default:
+        return -1;
+    }
+  }
+  release_chain();
+  reset_wbuf();
+  return 0;
+}
+
 int Conn::put_string(cchar *str, int len) {
   cchar *s = str;
   while (1) {
@@ -109,64 +392,243 @@ int Conn::put_string(cchar *str, int len) {
   }
 }
 
-int Conn::put() {
-  byte *str = wbuf.cur;
-  (void)str;
+static buffer_t *alloc_segment(byte *buf, int size, int flags) {
+  buffer_t *b = segment_freelist.alloc();
+  b->buf = b->cur = b->end = b->line = buf;
+  b->bufend = buf + size;
+  b->next = 0;
+  b->flags = flags;
+  return b;
+}
+
+static void free_segment(Conn *c, buffer_t *b) {
+  if (b->flags & BUFFER_OWNED) c->free_iobuf(b->buf, b->bufend - b->buf);
+  if (b->flags & BUFFER_POOLED) segment_freelist.free(b);
+}
+
+void Conn::add_buffer(byte *buf, int len) {
+  buffer_t *b = alloc_segment(buf, len, BUFFER_POOLED);
+  b->end = b->bufend;
+  buffer_t *t = &wbuf;
+  while (t->next) t = t->next;
+  t->next = b;
+  wqueue(len);
+}
+
+void Conn::add_file(int fd, int64 offset, int64 len) {
+  buffer_t *b = alloc_segment(0, 0, BUFFER_POOLED | BUFFER_FILE);
+  b->fd = fd;
+  b->cur = (byte *)(intptr_t)offset;
+  b->end = (byte *)(intptr_t)(offset + len);
+  buffer_t *t = &wbuf;
+  while (t->next) t = t->next;
+  t->next = b;
+}
+
+int Conn::append_wbuf(const byte *s, int n) {
+  wqueue(n);
+  buffer_t *t = &wbuf;
+  while (t->next) t = t->next;
   while (1) {
-    int r = 0;
-    if (!wbuf.next) {
-      int len = wbuf.end - wbuf.cur;
-      r = write(ofd, wbuf.cur, len);
-    } else {
-      int n = 2;
-      buffer_t *b = wbuf.next;
-      while (b) {
-        n++;
-        b = b->next;
-      }
-      struct iovec *iovec = (struct iovec *)malloc(sizeof(struct iovec) * n);
-      b = &wbuf;
-      int i = 0;
-      while (b) {
-        iovec[i].iov_base = b->cur;
-        int l = b->end - b->cur;
-        iovec[i].iov_len = l;
-        b = b->next;
-        r = writev(ofd, iovec, n);
-      }
-      ::free(iovec);
-    }
-    if (r < 0) {
-      switch (errno) {
-        case EINTR:
-          continue;
-        default:
-          return -1;
+    int growing = t == &wbuf || (t->flags & BUFFER_OWNED);
+    if (growing) {
+      int room = t->bufend - t->end;
+      if (room > n) room = n;
+      if (room) {
+        memcpy(t->end, s, room);
+        t->end += room;
+        s += room;
+        n -= room;
       }
     }
-    reset_wbuf();
-    return 0;
+    if (!n) return 0;
+    int size = growing ? (t->bufend - t->buf) * 2 : IOBUF_SMALL;  // segments double
+    if (size < n) size = n;
+    if (size > IOBUF_LARGE && n <= IOBUF_LARGE) size = IOBUF_LARGE;
+    byte *b = alloc_iobuf(size);
+    t = t->next = alloc_segment(b, size, BUFFER_POOLED | BUFFER_OWNED);
   }
 }
 
+int Conn::fill_iov() {
+  int n = 0;
+  for (buffer_t *b = &wbuf; b; b = b->next) {
+    if (b->cur == b->end) continue;
+    if (b->flags & BUFFER_FILE) break;
+    if (n == iov_size) {
+      if (iov_size == IOV_MAX) break;  // the rest goes in the next write
+      int size = iov_size ? iov_size * 2 : CONN_IOV_INITIAL;
+      if (size > IOV_MAX) size = IOV_MAX;
+      struct iovec *v = (struct iovec *)MALLOC(sizeof(struct iovec) * size);
+      if (n) memcpy(v, iov, sizeof(struct iovec) * n);
+      FREE(iov);
+      iov = v;
+      iov_size = size;
+    }
+    iov[n].iov_base = b->cur;
+    iov[n].iov_len = b->end - b->cur;
+    n++;
+  }
+  return n;
+}
+
+void Conn::consumed(int64 n) {
+  int64 m = 0;  // from memory
+  for (buffer_t *b = &wbuf; b && n; b = b->next) {
+    int64 l = b->end - b->cur;
+    if (l > n) l = n;
+    b->cur += l;
+    n -= l;
+    if (!(b->flags & BUFFER_FILE)) m += l;
+  }
+  wqueue(-m);
+  if (wbuf.cur != wbuf.end) return;
+  while (wbuf.next && wbuf.next->cur == wbuf.next->end) {
+    buffer_t *b = wbuf.next;
+    wbuf.next = b->next;
+    free_segment(this, b);
+  }
+}
+
+// drop the chain, written or not
+void Conn::release_chain() {
+  while (wbuf.next) {
+    buffer_t *b = wbuf.next;
+    wbuf.next = b->next;
+    if (!(b->flags & BUFFER_FILE)) wqueue(-(int64)(b->end - b->cur));
+    free_segment(this, b);
+  }
+}
+
+void Conn::wqueue(int64 n) {
+  wqueued += n;
+  int64 total = factory ? __atomic_add_fetch(&factory->write_queued, n, __ATOMIC_RELAXED) : 0;
+  if (n > 0 && !throttled) {
+    if ((write_high && wqueued > write_high) ||
+        (factory && factory->write_budget && total > ((int64)factory->write_budget << 20))) {
+      throttled = 1;
+      write_throttled(1);
+    }
+  } else if (n < 0 && throttled && wqueued <= write_low) {
+    throttled = 0;
+    write_throttled(0);
+  }
+}
+
+int Conn::put() {
+  while (1) {
+    int r = write_some();
+    if (r > 0) continue;
+    if (!r) break;
+    if (errno != EINTR) return -1;
+  }
+  release_chain();
+  reset_wbuf();
+  return 0;
+}
+
+int Conn::write_some() {
+#ifdef __linux__
+  if (piped) {  // spliced from a file segment, ahead of the rest of the chain
+    int r = splice(pipefd[0], 0, ofd, 0, piped, SPLICE_F_MOVE);
+    if (r > 0) piped -= r;
+    return r;
+  }
+#endif
+  buffer_t *b = unwritten();
+  if (!b) return 0;
+  if (b->flags & BUFFER_FILE) return send_file(b);
+  int r;
+  if (!wbuf.next)
+    r = write(ofd, wbuf.cur, wbuf.end - wbuf.cur);
+  else
+    r = writev(ofd, iov, fill_iov());
+  if (r > 0) consumed(r);
+  return r;
+}
+
+int Conn::send_file(buffer_t *b) {
+  int64 len = b->end - b->cur;
+  if (len > CONN_SENDFILE_CHUNK) len = CONN_SENDFILE_CHUNK;
+  off_t off = (off_t)(intptr_t)b->cur;
+  ssize_t r;
+#ifdef __linux__
+  r = sendfile(ofd, b->fd, &off, len);
+  if (r < 0 && (errno == EINVAL || errno == ENOSYS)) {  // fd doesn't support it, go through a pipe
+    if (pipefd[0] < 0 && pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) < 0) return -1;
+    loff_t loff = off;
+    r = splice(b->fd, &loff, pipefd[1], 0, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (r < 0 && errno == ESPIPE) r = splice(b->fd, 0, pipefd[1], 0, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (r > 0) {
+      consumed(r);
+      piped = r;
+      int w = splice(pipefd[0], 0, ofd, 0, piped, SPLICE_F_MOVE);
+      if (w > 0) piped -= w;
+      return r;
+    }
+  }
+#else
+  byte tmp[65536];
+  if (len > (int64)sizeof(tmp)) len = sizeof(tmp);
+  r = pread(b->fd, tmp, len, off);
+  if (r > 0) r = write(ofd, tmp, r);
+#endif
+  if (!r) {  // the file is shorter than what was queued
+    errno = EIO;
+    return -1;
+  }
+  if (r > 0) consumed(r);
+  return r;
+}
+
 int Conn::done() {
+  close_fds();
+  free();
+  return 0;
+}
+
+void Conn::close_fds() {
+  unlink_conn();
+  if (reactor) reactor->remove(this);
   if (ifd != -1 && ifd >= STDERR_FILENO) {
     ::close(ifd);
   }
   if (ofd != ifd && ofd != -1 && ofd >= STDERR_FILENO) {
     ::close(ofd);
   }
-  pthread_mutex_t *l = &factory->lock;
-  pthread_mutex_lock(l);
-  free();
-  pthread_mutex_unlock(l);
-  return 0;
+  if (pipefd[0] >= 0) {
+    ::close(pipefd[0]);
+    ::close(pipefd[1]);
+    pipefd[0] = pipefd[1] = -1;
+  }
+  piped = 0;
+}
+
+void Conn::unlink_conn() {
+  if (reactor)
+    reactor->conns.remove(this);
+  else if (factory) {
+    pthread_mutex_lock(&factory->lock);
+    factory->conns.remove(this);
+    pthread_mutex_unlock(&factory->lock);
+  }
 }
 
 void Conn::free() {
-  if (factory->conn_freelist) factory->conn_freelist->free(this);
-  FREE(rbuf.buf);
-  FREE(wbuf.buf);
+  unlink_conn();
+  release_chain();
+  wqueue(-wqueued);
+  FREE(iov);
+  iov = 0;
+  iov_size = 0;
+  if (rbuf.buf) free_iobuf(rbuf.buf, rbuf.bufend - rbuf.buf);
+  if (wbuf.buf) free_iobuf(wbuf.buf, wbuf.bufend - wbuf.buf);
+  rbuf.buf = wbuf.buf = 0;
+  ConcurrentFreeList *l = factory ? factory->conn_freelist : 0;
+  if (l) {
+    this->~Conn();
+    l->free(this);
+  }
 }
 
 int Conn::error(cchar *s) {
@@ -187,6 +649,8 @@ void add_string_buffer(Vec<buffer_t> &bufs, byte *buf, int len) {
   bufs.add();
   bufs.v[i].buf = bufs.v[i].cur = buf;
   bufs.v[i].end = bufs.v[i].bufend = buf + len;
+  bufs.v[i].next = 0;
+  bufs.v[i].flags = 0;
 }
 
 char *Conn::alloc_xml_value(char *s, char *e, char **r) {
@@ -199,29 +663,884 @@ char *Conn::alloc_xml_value(char *s, char *e, char **r) {
   return alloc_str(p, pe - p);
 }
 
-char *Conn::alloc_date_str() {
+static int format_date(char *buf, time_t t) {
+  struct tm m;
+  gmtime_r(&t, &m);
+  return snprintf(buf, CONN_DATE_SIZE, "%s, %02u %s %04u %02u:%02u:%02u GMT", weekdays[m.tm_wday], m.tm_mday,
+                  months[m.tm_mon], 1900 + m.tm_year, m.tm_hour, m.tm_min, m.tm_sec);
+}
+
+int copy_date_str(char *buf) {
   time_t t = time(0);
-  pthread_mutex_lock(&date_mutex);
-  if (t != date_time) {
-    date_time = t;
-    struct tm m;
-    gmtime_r(&t, &m);
-    date_string_len =
-        snprintf(date_string, sizeof(date_string), "%s, %02u %s %04u %02u:%02u:%02u GMT", weekdays[m.tm_wday],
-                 m.tm_mday, months[m.tm_mon], 1900 + m.tm_year, m.tm_hour, m.tm_min, m.tm_sec);
+  DateString *d = __atomic_load_n(&date_current, __ATOMIC_ACQUIRE);
+  if (d->time != t) {
+    time_t claimed = __atomic_load_n(&date_claimed, __ATOMIC_RELAXED);
+    // another thread is formatting this second: format a private copy rather than wait
+    if (claimed == t || !__atomic_compare_exchange_n(&date_claimed, &claimed, t, false, __ATOMIC_ACQUIRE,
+                                                     __ATOMIC_RELAXED))
+      return format_date(buf, t);
+    d = &date_strings[__atomic_fetch_add(&date_next, 1, __ATOMIC_RELAXED) % DATE_SLOTS];
+    d->len = format_date(d->s, t);
+    d->time = t;
+    __atomic_store_n(&date_current, d, __ATOMIC_RELEASE);
+  }
+  memcpy(buf, d->s, d->len + 1);
+  return d->len;
+}
+
+char *Conn::alloc_date_str() {
+  char s[CONN_DATE_SIZE];
+  int l = copy_date_str(s);
+  return alloc_str(s, l);
+}
+
+int Conn::append_date() {
+  char s[CONN_DATE_SIZE];
+  int l = copy_date_str(s);
+  return append_string(s, l);
+}
+
+/*
+  Accepting
+
+  With reactors each event loop thread polls its listening socket
+  (EPOLLEXCLUSIVE so one is woken per connection when it is shared), or
+  with io_uring keeps a multishot accept pending on it, and keeps the
+  connections it accepts.  Otherwise accept threads add each connection to
+  the thread pool.
+*/
+
+static void pin_thread(int cpu) {
+#ifdef __linux__
+  if (cpu < 0) return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+static void set_nodelay(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+}
+
+// set up a new connection on fd, closing it if there is no Conn
+Conn *ConnFactory::accepted(int afd, Reactor *r) {
+  Conn *c = new_conn();
+  if (!c) {
+    ::close(afd);
+    return 0;
+  }
+  set_nodelay(afd);
+  c->ifd = c->ofd = afd;
+  c->factory = this;
+  c->reactor = r;
+  if (r)
+    r->conns.push(c);
+  else {
+    pthread_mutex_lock(&lock);
+    conns.push(c);
+    pthread_mutex_unlock(&lock);
   }
-  char *ret = alloc_str(date_string, date_string_len);
-  pthread_mutex_unlock(&date_mutex);
-  return ret;
+  c->uring_flags = 0;
+  c->wqueued = 0;
+  c->throttled = 0;
+  c->write_high = write_high;
+  c->write_low = write_low ? write_low : write_high / 2;
+  int size = iobuf_size > 0 ? iobuf_size : (r ? DEFAULT_REACTOR_IOBUF_SIZE : DEFAULT_IOBUF_SIZE);
+  if (!c->rbuf_size) c->rbuf_size = size;
+  if (!c->wbuf_size) c->wbuf_size = size;
+  if (!r) c->alloc_buffers();
+  return c;
+}
+
+static void *conn_factory_accept(void *data) {
+  ConnAcceptor *a = (ConnAcceptor *)data;
+  ConnFactory *f = a->factory;
+  pin_thread(a->cpu);
+  while (!f->stopping) {
+    int fd = accept(a->fd, 0, 0);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (f->stopping) break;
+      wait_for(HRTIME_MSEC);  // e.g. out of fds
+      continue;
+    }
+    if (Conn *c = f->accepted(fd, 0)) f->thread_pool.add_job(c);
+  }
+  return 0;
+}
+
+#ifdef __linux__
+
+static void *reactor_main(void *data) {
+  Reactor *r = (Reactor *)data;
+  pin_thread(r->cpu);
+  r->run();
+  return 0;
+}
+
+EpollReactor::EpollReactor(ConnFactory *afactory, int alisten_fd) : Reactor(afactory, alisten_fd) {
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = this;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+  ev.events = factory->reuseport ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = factory;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+}
+
+EpollReactor::~EpollReactor() {
+  ::close(wakefd);
+  ::close(epfd);
+}
+
+int EpollReactor::add(Conn *c) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = c;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, c->ifd, &ev);
+}
+
+void EpollReactor::accept_conns() {
+  while (1) {
+    int fd = accept4(listen_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      return;  // EAGAIN, or e.g. out of fds in which case the listen socket stays readable
+    }
+    Conn *c = factory->accepted(fd, this);
+    if (c && add(c) < 0) c->done();
+  }
+}
+
+void EpollReactor::run() {
+  struct epoll_event ev[REACTOR_MAX_EVENTS];
+  while (!factory->stopping) {
+    int n = epoll_wait(epfd, ev, REACTOR_MAX_EVENTS, -1);
+    for (int i = 0; i < n; i++) {
+      void *p = ev[i].data.ptr;
+      if (p == this) {
+        uint64 x;
+        if (read(wakefd, &x, sizeof(x)) < 0) continue;
+      } else if (p == factory)
+        accept_conns();
+      else {
+        Conn *c = (Conn *)p;
+        c->alloc_buffers();
+        if (c->ready(ev[i].events) < 0)
+          c->done();
+        else
+          c->release_buffers();
+      }
+    }
+  }
+  while (Conn *c = conns.pop()) c->done();
+}
+
+void EpollReactor::wake() {
+  uint64 x = 1;
+  if (write(wakefd, &x, sizeof(x)) < 0) perror("write");
+}
+
+#else
+
+EpollReactor::EpollReactor(ConnFactory *afactory, int alisten_fd)
+    : Reactor(afactory, alisten_fd), epfd(-1), wakefd(-1) {}
+EpollReactor::~EpollReactor() {}
+int EpollReactor::add(Conn *c) { return -1; }
+void EpollReactor::accept_conns() {}
+void EpollReactor::run() {}
+void EpollReactor::wake() {}
+
+#endif
+
+#ifdef HAVE_IO_URING
+
+// user_data is the Conn (or 0) with the operation in the low bits
+#define URING_RECV 1
+#define URING_POLL 2
+#define URING_SEND 3
+#define URING_ACCEPT 4
+#define URING_WAKE 5
+#define URING_WPOLL 6  // waiting to write a file segment
+#define URING_OP_MASK 7
+
+static inline uint64 uring_data(void *p, int op) { return (uint64)(uintptr_t)p | op; }
+
+UringReactor::UringReactor(ConnFactory *afactory, int alisten_fd)
+    : Reactor(afactory, alisten_fd), wakefd(-1), wakeval(0), files(0), multishot(1), pool(0), buffer_size(0), nbuffers(0) {
+  completions = 1;
+}
+
+UringReactor::~UringReactor() {
+  if (pool) munmap(pool, (size_t)buffer_size * nbuffers);
+  if (wakefd >= 0) ::close(wakefd);
+}
+
+int UringReactor::init() {
+  if (ring.init(DEFAULT_REACTOR_URING_ENTRIES) < 0) return -1;
+  if ((wakefd = eventfd(0, EFD_CLOEXEC)) < 0) return -1;
+  int n = REACTOR_URING_MAX_FILES;
+  struct rlimit rl;
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < (rlim_t)n) n = (int)rl.rlim_cur;
+  if (!ring.register_files(n)) files = n;
+  buffer_size = factory->iobuf_size > 0 ? factory->iobuf_size : DEFAULT_REACTOR_IOBUF_SIZE;
+  if (factory->uring_buffers > 0) {
+    size_t len = (size_t)buffer_size * factory->uring_buffers;
+    pool = (byte *)mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == (byte *)MAP_FAILED)
+      pool = 0;
+    else if (ring.register_buffer(pool, len) < 0) {  // e.g. RLIMIT_MEMLOCK
+      munmap(pool, len);
+      pool = 0;
+    } else {
+      nbuffers = factory->uring_buffers;
+      for (int i = nbuffers - 1; i >= 0; i--) free_buffers.add(pool + (size_t)i * buffer_size);
+    }
+  }
+  arm_wake();
+  arm_accept();
+  return 0;
+}
+
+void UringReactor::arm_accept() {
+  struct io_uring_sqe *sqe = ring.get_sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_fd;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  if (multishot) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = uring_data(0, URING_ACCEPT);
+}
+
+void UringReactor::arm_wake() {
+  struct io_uring_sqe *sqe = ring.get_sqe();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = wakefd;
+  sqe->addr = (uint64)(uintptr_t)&wakeval;
+  sqe->len = sizeof(wakeval);
+  sqe->user_data = uring_data(0, URING_WAKE);
+}
+
+struct io_uring_sqe *UringReactor::conn_sqe(Conn *c, int op) {
+  struct io_uring_sqe *sqe = ring.get_sqe();
+  sqe->fd = c->ifd;
+  if (c->uring_flags & CONN_URING_FIXED) sqe->flags = IOSQE_FIXED_FILE;
+  sqe->user_data = uring_data(c, op);
+  return sqe;
+}
+
+void UringReactor::submit_recv(Conn *c) {
+  struct io_uring_sqe *sqe = conn_sqe(c, URING_RECV);
+  if (pool && c->rbuf.buf >= pool && c->rbuf.buf < pool + (size_t)buffer_size * nbuffers) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->buf_index = 0;
+  } else
+    sqe->opcode = IORING_OP_RECV;
+  sqe->addr = (uint64)(uintptr_t)c->rbuf.end;
+  sqe->len = c->rbuf.bufend - c->rbuf.end;
+  c->uring_recv = c->rbuf.end;
+  c->uring_flags |= CONN_URING_READ;
+}
+
+int UringReactor::read_some(Conn *c) {
+  if (c->uring_flags & CONN_URING_EOF) return -1;
+  if (c->uring_flags & (CONN_URING_READ | CONN_URING_POLL)) return 0;
+  if (c->rbuf.end == c->rbuf.bufend && c->make_room() < 0) return -1;
+  if (c->rbuf.cur == c->rbuf.end) {  // idle: don't tie up the buffer until there is input
+    struct io_uring_sqe *sqe = conn_sqe(c, URING_POLL);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = POLLIN | POLLRDHUP;
+    c->uring_flags |= CONN_URING_POLL;
+  } else
+    submit_recv(c);
+  return 0;
+}
+
+int UringReactor::flush(Conn *c) {
+  if (c->uring_flags & CONN_URING_ERROR) return -1;
+  if (c->uring_flags & CONN_URING_WRITE) return 1;
+  buffer_t *b;
+  // file segments are sent directly, the socket is non-blocking
+  while (c->piped || ((b = c->unwritten()) && (b->flags & BUFFER_FILE))) {
+    if (c->write_some() > 0 || errno == EINTR) continue;
+    if (errno != EAGAIN) {
+      c->uring_flags |= CONN_URING_ERROR;
+      return -1;
+    }
+    struct io_uring_sqe *sqe = conn_sqe(c, URING_WPOLL);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = POLLOUT;
+    c->uring_flags |= CONN_URING_WRITE;
+    return 1;
+  }
+  struct io_uring_sqe *sqe;
+  if (!c->wbuf.next) {
+    if (c->wbuf.cur == c->wbuf.end) {
+      c->reset_wbuf();
+      return 0;
+    }
+    sqe = conn_sqe(c, URING_SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr = (uint64)(uintptr_t)c->wbuf.cur;
+    sqe->len = c->wbuf.end - c->wbuf.cur;
+  } else {
+    int n = c->fill_iov();
+    if (!n) {
+      c->release_chain();
+      c->reset_wbuf();
+      return 0;
+    }
+    memset(&c->uring_msg, 0, sizeof(c->uring_msg));
+    c->uring_msg.msg_iov = c->iov;
+    c->uring_msg.msg_iovlen = n;
+    sqe = conn_sqe(c, URING_SEND);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (uint64)(uintptr_t)&c->uring_msg;
+    sqe->len = 1;
+  }
+  sqe->msg_flags = MSG_NOSIGNAL;
+  c->uring_flags |= CONN_URING_WRITE;
+  return 1;
+}
+
+void UringReactor::remove(Conn *c) {
+  if (c->uring_flags & CONN_URING_FIXED) {
+    ring.update_file(c->ifd, -1);
+    c->uring_flags &= ~CONN_URING_FIXED;
+  }
+}
+
+// the kernel still owns buffers with I/O in flight, shut the socket down and finish when it completes
+void UringReactor::close(Conn *c) {
+  if (c->uring_flags & CONN_URING_PENDING) {
+    if (!(c->uring_flags & CONN_URING_CLOSING)) ::shutdown(c->ifd, SHUT_RDWR);
+    c->uring_flags |= CONN_URING_CLOSING;
+    return;
+  }
+  c->done();
+}
+
+void UringReactor::accepted(int afd) {
+  Conn *c = factory->accepted(afd, this);
+  if (!c) return;
+  if (afd < files && !ring.update_file(afd, afd)) c->uring_flags |= CONN_URING_FIXED;
+  c->alloc_buffers();
+  if (c->ready(EPOLLOUT) < 0)
+    close(c);
+  else
+    c->release_buffers();
+}
+
+void UringReactor::completed(Conn *c, int op, int res) {
+  int events = 0;
+  switch (op) {
+    case URING_POLL:
+      c->uring_flags &= ~CONN_URING_POLL;
+      if (c->uring_flags & CONN_URING_CLOSING) break;
+      if (res < 0 && res != -EINTR) {
+        c->uring_flags |= CONN_URING_EOF;
+        events = EPOLLIN | EPOLLERR;
+        break;
+      }
+      c->alloc_buffers();
+      submit_recv(c);
+      return;
+    case URING_RECV:
+      c->uring_flags &= ~CONN_URING_READ;
+      if (res > 0) {
+        // the connection may have moved its data down (check_rbuf(), reset_rbuf()) meanwhile
+        if (c->uring_recv != c->rbuf.end) memmove(c->rbuf.end, c->uring_recv, res);
+        c->rbuf.end += res;
+        events = EPOLLIN;
+      } else if (res == -EINTR || res == -EAGAIN)
+        events = EPOLLIN;
+      else {
+        c->uring_flags |= CONN_URING_EOF;
+        events = EPOLLIN | EPOLLRDHUP | (res < 0 ? EPOLLERR : 0);
+      }
+      break;
+    case URING_WPOLL:
+      c->uring_flags &= ~CONN_URING_WRITE;
+      events = EPOLLOUT;
+      break;
+    case URING_SEND:
+      c->uring_flags &= ~CONN_URING_WRITE;
+      if (res >= 0) {
+        c->consumed(res);
+        events = EPOLLOUT;
+      } else if (res == -EINTR || res == -EAGAIN)
+        events = EPOLLOUT;
+      else {
+        c->uring_flags |= CONN_URING_ERROR;
+        events = EPOLLOUT | EPOLLERR;
+      }
+      break;
+  }
+  if (c->uring_flags & CONN_URING_CLOSING) {
+    close(c);
+    return;
+  }
+  c->alloc_buffers();
+  if (c->ready(events) < 0)
+    close(c);
+  else
+    c->release_buffers();
+}
+
+void UringReactor::run() {
+  struct io_uring_cqe cqe[REACTOR_MAX_EVENTS];
+  while (!factory->stopping) {
+    int n = ring.wait(cqe, REACTOR_MAX_EVENTS);
+    if (n < 0) {
+      perror("io_uring_enter");
+      wait_for(HRTIME_MSEC);
+    }
+    for (int i = 0; i < n; i++) {
+      int op = (int)(cqe[i].user_data & URING_OP_MASK), res = cqe[i].res;
+      if (op == URING_WAKE)
+        arm_wake();
+      else if (op == URING_ACCEPT) {
+        if (res >= 0)
+          accepted(res);
+        else if (res == -EINVAL && multishot)
+          multishot = 0;  // kernel before 5.19
+        else if (res == -EMFILE || res == -ENFILE)
+          wait_for(HRTIME_MSEC);
+        if (!(cqe[i].flags & IORING_CQE_F_MORE)) arm_accept();
+      } else
+        completed((Conn *)(uintptr_t)(cqe[i].user_data & ~(uint64)URING_OP_MASK), op, res);
+    }
+  }
+  // close the conns, those with I/O in flight once it completes and the kernel is done with their buffers
+  for (Conn *c = conns.head, *next; c; c = next) {
+    next = conns.next(c);
+    close(c);
+  }
+  while (conns.head) {
+    int n = ring.wait(cqe, REACTOR_MAX_EVENTS);
+    if (n < 0) break;
+    for (int i = 0; i < n; i++) {
+      int op = (int)(cqe[i].user_data & URING_OP_MASK), res = cqe[i].res;
+      if (op == URING_ACCEPT) {
+        if (res >= 0) ::close(res);
+      } else if (op != URING_WAKE)
+        completed((Conn *)(uintptr_t)(cqe[i].user_data & ~(uint64)URING_OP_MASK), op, res);
+    }
+  }
+}
+
+void UringReactor::wake() {
+  uint64 x = 1;
+  if (write(wakefd, &x, sizeof(x)) < 0) perror("write");
+}
+
+byte *UringReactor::alloc_buffer(int &size) {
+  if (size <= buffer_size && free_buffers.n) {
+    size = buffer_size;
+    return free_buffers.pop();
+  }
+  return iobuf_pool.alloc(size);
+}
+
+void UringReactor::free_buffer(byte *b, int size) {
+  if (pool && b >= pool && b < pool + (size_t)buffer_size * nbuffers)
+    free_buffers.add(b);
+  else
+    iobuf_pool.free(b, size);
+}
+
+#endif
+
+#ifdef __linux__
+static Reactor *new_reactor(ConnFactory *f, int lfd) {
+#ifdef HAVE_IO_URING
+  if (f->io_uring) {
+    UringReactor *r = new UringReactor(f, lfd);
+    if (!r->init()) return r;
+    delete r;  // fall back to epoll
+  }
+#endif
+  return new EpollReactor(f, lfd);
+}
+#endif
+
+int ConnFactory::listen_socket(int i) {
+  int lfd = bind_port(port, SOCK_STREAM, false, reuseport);
+  if (lfd < 0) return -1;
+  if (!i) {
+    fd = lfd;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (!port && !getsockname(fd, (struct sockaddr *)&addr, &len)) port = ntohs(addr.sin_port);  // for the others
+  }
+  listen_fds.add(lfd);
+  return lfd;
+}
+
+int ConnFactory::start() {
+  if (listen_socket(0) < 0) return -1;
+  stopping = 0;
+  Vec<int> cpus;
+  if (acceptor_cpus) parse_cpulist(acceptor_cpus, cpus);
+#ifdef __linux__
+  if (nreactors > 0) {
+    reactors = (Reactor **)MALLOC(sizeof(Reactor *) * nreactors);
+    for (int i = 0; i < nreactors; i++) {
+      int lfd = i && reuseport ? listen_socket(i) : fd;
+      if (lfd < 0) lfd = fd;
+      fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK);
+      reactors[i] = new_reactor(this, lfd);
+      reactors[i]->cpu = cpus.n ? cpus[i % cpus.n] : -1;
+      reactors[i]->thread = create_thread(reactor_main, reactors[i]);
+    }
+    return 0;
+  }
+#endif
+  if (acceptors < 1) acceptors = 1;
+  acceptor = (ConnAcceptor *)MALLOC(sizeof(ConnAcceptor) * acceptors);
+  for (int i = 0; i < acceptors; i++) {
+    ConnAcceptor &a = acceptor[i];
+    a.factory = this;
+    a.fd = i && reuseport ? listen_socket(i) : fd;
+    if (a.fd < 0) a.fd = fd;
+    a.cpu = cpus.n ? cpus[i % cpus.n] : -1;
+    a.thread = create_thread(conn_factory_accept, &a);
+  }
+  return 0;
+}
+
+/*
+  The freelist is owned here rather than by a subclass, which would destroy
+  it before the base thread_pool is shut down, while pool threads finishing
+  a Conn::main() may still free conns into it.  Every conn is closed and
+  freed before it goes.
+*/
+ConnFactory::~ConnFactory() {
+  stop();
+  close_conns();
+  delete conn_freelist;
+}
+
+static void close_queued_conn(ThreadPoolJob *job) { ((Conn *)job)->done(); }
+
+void ConnFactory::close_conns() {
+  pthread_mutex_lock(&lock);
+  for (Conn *c = conns.head; c; c = conns.next(c)) ::shutdown(c->ifd, SHUT_RD);  // ends their reads
+  pthread_mutex_unlock(&lock);
+  thread_pool.shutdown();
+  thread_pool.drain(close_queued_conn);
+}
+
+void ConnFactory::stop() {
+  stopping = 1;
+  if (reactors) {
+    for (int i = 0; i < nreactors; i++) reactors[i]->wake();
+    for (int i = 0; i < nreactors; i++) {
+      pthread_join(reactors[i]->thread, 0);
+      delete reactors[i];
+    }
+    FREE(reactors);
+    reactors = 0;
+  } else if (acceptor) {
+    for (int i = 0; i < acceptors; i++) ::shutdown(acceptor[i].fd, SHUT_RDWR);  // wakes the accept threads
+    for (int i = 0; i < acceptors; i++) pthread_join(acceptor[i].thread, 0);
+    FREE(acceptor);
+    acceptor = 0;
+  }
+  for (int i = 0; i < listen_fds.n; i++) ::close(listen_fds[i]);
+  listen_fds.clear();
+  fd = -1;
 }
 
 ConnFactory::ConnFactory(cchar *aname) : name(aname) {
   fd = -1;
   conn_freelist = 0;
+  reactors = 0;
+  acceptor = 0;
+  stopping = 0;
+  write_queued = 0;
   pthread_mutex_init(&lock, 0);
   int_config(DYNAMIC_CONFIG, &port, 0, name, "port");
+  thread_pool.stats_name = name;
   int_config(DYNAMIC_CONFIG, &thread_pool.maxthreads, DEFAULT_FACTORY_THREADS, name, "threads");
   int_config(DYNAMIC_CONFIG, &thread_pool.stacksize, DEFAULT_FACTORY_STACKSIZE, name, "stacksize");
+  int_config(DYNAMIC_CONFIG, &thread_pool.minthreads, DEFAULT_FACTORY_MINTHREADS, name, "minthreads");
+  int_config(DYNAMIC_CONFIG, &thread_pool.idle_timeout, DEFAULT_FACTORY_IDLE_TIMEOUT, name, "idle_timeout");
+  int_config(DYNAMIC_CONFIG, &thread_pool.spawn_delay, DEFAULT_FACTORY_SPAWN_DELAY, name, "spawn_delay");
+  int_config(GET_CONFIG, &thread_pool.work_stealing, 0, name, "work_stealing");  // fixed once started
+  string_config(GET_CONFIG, &thread_pool.cpus, 0, name, "cpus");
+  int_config(GET_CONFIG, &thread_pool.numa, 0, name, "numa");
+  int_config(GET_CONFIG, &nreactors, DEFAULT_FACTORY_REACTORS, name, "reactors");
+  int_config(GET_CONFIG, &acceptors, DEFAULT_FACTORY_ACCEPTORS, name, "acceptors");
+  int_config(GET_CONFIG, &reuseport, 0, name, "reuseport");
+  string_config(GET_CONFIG, &acceptor_cpus, 0, name, "acceptor_cpus");
+  int_config(DYNAMIC_CONFIG, &write_high, DEFAULT_FACTORY_WRITE_HIGH, name, "write_high");
+  int_config(DYNAMIC_CONFIG, &write_low, 0, name, "write_low");
+  int_config(DYNAMIC_CONFIG, &write_budget, DEFAULT_FACTORY_WRITE_BUDGET, name, "write_budget");
+  int_config(GET_CONFIG, &iobuf_size, 0, name, "iobuf_size");
+  int_config(GET_CONFIG, &io_uring, 0, name, "io_uring");
+  int_config(GET_CONFIG, &uring_buffers, DEFAULT_REACTOR_URING_BUFFERS, name, "uring_buffers");
 }
 
 Server::Server(cchar *aname) : ConnFactory(aname) {}
+
+#ifdef TEST_LIB
+#define TEST_CONN_CLIENTS 50
+#define TEST_CONN_SEGMENTS (IOV_MAX + 500)  // more than one writev
+#define TEST_CONN_SEGMENT_SIZE 100
+
+static byte test_conn_data[TEST_CONN_SEGMENTS * TEST_CONN_SEGMENT_SIZE];
+static int test_conn_file = -1;  // holds test_conn_data
+
+static int test_conn_throttled = 0;  // write_throttled(1) calls
+
+class TestConn final : public Conn {
+ public:
+  HeaderIndex hx;
+  int in_headers = 0;
+
+  void write_throttled(int on) {
+    if (on) __atomic_add_fetch(&test_conn_throttled, 1, __ATOMIC_RELAXED);
+  }
+  void answer() {  // echo, or "chain" gets test_conn_data as a chain of segments
+    append_string((char *)rbuf.line, rbuf.line_len());
+    if (rbuf.line_len() == 5 && !memcmp(rbuf.line, "many\n", 5))  // more than the initial wbuf
+      for (int i = 0; i < 1000; i++) APPEND_TO_BUF(wbuf, "0123456789");
+    if (rbuf.line_len() == 8 && !memcmp(rbuf.line, "headers\n", 8)) {  // followed by a header block
+      hx.clear();
+      in_headers = 1;
+    }
+    if (rbuf.line_len() == 6 && !memcmp(rbuf.line, "chain\n", 6))
+      for (int i = 0; i < TEST_CONN_SEGMENTS; i++)
+        add_buffer(test_conn_data + i * TEST_CONN_SEGMENT_SIZE, TEST_CONN_SEGMENT_SIZE);
+    if (rbuf.line_len() == 5 && !memcmp(rbuf.line, "file\n", 5)) {  // "file\n", file from offset 7, "end\n"
+      add_file(test_conn_file, 7, sizeof(test_conn_data) - 7);
+      append_string("end\n");
+    }
+  }
+  void answer_headers() {  // "<count> <content-length> <length of x-long>\n"
+    int l = HEADER_FIND(hx, "Content-Length"), x = hx.find("x-long");
+    assert(l >= 0 && x >= 0 && hx.find("missing") < 0);
+    append_print("%d %.*s %d\n", hx.n, hx.h[l].value_len, (char *)hx.value(l), hx.h[x].value_len);
+    in_headers = 0;
+  }
+  int main() {  // blocking
+    while (!get_line()) {
+      answer();
+      if (in_headers) {
+        if (get_headers(hx)) break;
+        answer_headers();
+      }
+      if (put()) break;
+    }
+    done();
+    return 0;
+  }
+  int ready(int events) {  // non-blocking
+    while (1) {
+      if (wbuf.cur < wbuf.end || wbuf.next) {
+        int r = flush();
+        if (r) return r < 0 ? -1 : 0;
+      }
+      int r = in_headers ? try_get_headers(hx) : try_get_line();
+      if (r <= 0) return r;
+      if (in_headers)
+        answer_headers();
+      else
+        answer();
+      if (rbuf.cur == rbuf.end) reset_rbuf();
+    }
+  }
+};
+
+class TestConnFactory : public ConnFactory {
+ public:
+  Conn *new_conn() { return pooled_conn<TestConn>(); }
+  TestConnFactory() : ConnFactory("test_conn") { pool_conns<TestConn>(); }
+};
+
+void test_conn() {
+  for (int i = 0; i < (int)sizeof(test_conn_data); i++) test_conn_data[i] = (byte)(i * 7 + i / 251);
+  char tmpname[] = "/tmp/test_conn_XXXXXX";
+  test_conn_file = mkstemp(tmpname);
+  assert(test_conn_file >= 0);
+  unlink(tmpname);
+  assert(write(test_conn_file, test_conn_data, sizeof(test_conn_data)) == (int)sizeof(test_conn_data));
+  {  // published date, the same as a fresh one
+    char d[CONN_DATE_SIZE], e[CONN_DATE_SIZE];
+    int l;
+    while (1) {
+      time_t t = time(0);
+      l = copy_date_str(d);
+      struct tm m;
+      gmtime_r(&t, &m);
+      strftime(e, sizeof(e), "%a, %d %b %Y %H:%M:%S GMT", &m);
+      if (time(0) == t) break;  // else it may have crossed a second
+    }
+    assert(l == 29 && (int)strlen(d) == 29 && !strcmp(d, e));
+    char *s = Conn().alloc_date_str();
+    assert(!memcmp(s + 25, " GMT", 4));
+    FREE(s);
+  }
+  {  // vector scanners against a byte at a time at every alignment
+    byte b[200];
+    int nl[200], m;
+    for (int i = 0; i < 200; i++) b[i] = (i * 37) % 11 ? 'a' : '\n';
+    for (int o = 0; o < 40; o++) {
+      m = 0;
+      for (int i = o; i < 200; i++)
+        if (b[i] == '\n') m++;
+      assert(scan_lines(b + o, b + 200, nl, 200) == m);
+      for (int i = 0; i < m; i++) assert(b[o + nl[i]] == '\n' && (!i || nl[i - 1] < nl[i]));
+      assert(scan_line(b + o, b + 200) == memchr(b + o, '\n', 200 - o));
+      assert(!scan_line(b + 100, b + 100) && scan_lines(b + o, b + 200, nl, 2) == 2);
+    }
+  }
+  // thread per connection, epoll, io_uring, then epoll and threads listening with SO_REUSEPORT
+  for (int mode = 0; mode < 5; mode++) {
+    TestConnFactory f;
+    f.nreactors = mode && mode < 4 ? 2 : 0;
+    f.io_uring = mode == 2;
+    f.reuseport = mode >= 3;
+    f.acceptors = 2;
+    if (mode >= 3) f.acceptor_cpus = "0";
+    f.write_high = 64 * 1024;  // less than the "chain" response
+    f.port = 0;
+    assert(!f.start());
+    assert(f.listen_fds.n == (mode >= 3 ? 2 : 1));
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(f.fd, (struct sockaddr *)&addr, &len);
+    int fds[TEST_CONN_CLIENTS];
+    for (int i = 0; i < TEST_CONN_CLIENTS; i++) {
+      fds[i] = connect_socket(inet_addr("127.0.0.1"), ntohs(addr.sin_port));
+      assert(fds[i] >= 0);
+    }
+    for (int i = 0; i < TEST_CONN_CLIENTS; i++) {
+      char msg[64], buf[64];
+      int l = snprintf(msg, sizeof(msg), "hello %d\nworld\n", i), n = 0;
+      assert(write(fds[i], msg, l) == l);
+      while (n < l) {
+        int r = read(fds[i], buf + n, sizeof(buf) - n);
+        assert(r > 0);
+        n += r;
+      }
+      assert(n == l && !memcmp(msg, buf, l));
+    }
+    {  // a line longer than the initial buffers: rbuf grows and the echo spills into wbuf segments
+      int l = 10000, n = 0;
+      char *msg = (char *)MALLOC(l), *buf = (char *)MALLOC(l);
+      for (int i = 0; i < l - 1; i++) msg[i] = 'a' + i % 26;
+      msg[l - 1] = '\n';
+      assert(write(fds[1], msg, l) == l);
+      while (n < l) {
+        int r = read(fds[1], buf + n, l - n);
+        assert(r > 0);
+        n += r;
+      }
+      assert(!memcmp(msg, buf, l));
+      FREE(msg);
+      FREE(buf);
+    }
+    {  // large chained responses, pipelined and throttled, written with short writes while the client is slow
+      assert(write(fds[0], "chain\nchain\n", 12) == 12);
+      int one = 6 + sizeof(test_conn_data), size = 2 * one, n = 0;
+      byte *buf = (byte *)MALLOC(size);
+      wait_for(HRTIME_MSEC * 10);
+      while (n < size) {
+        int r = read(fds[0], buf + n, size - n);
+        assert(r > 0);
+        n += r;
+      }
+      for (int i = 0; i < 2; i++)
+        assert(!memcmp(buf + i * one, "chain\n", 6) && !memcmp(buf + i * one + 6, test_conn_data, one - 6));
+      for (int i = 0; i < 1000 && __atomic_load_n(&f.write_queued, __ATOMIC_RELAXED); i++) wait_for(HRTIME_MSEC);
+      assert(test_conn_throttled && !__atomic_load_n(&f.write_queued, __ATOMIC_RELAXED));
+      test_conn_throttled = 0;
+      FREE(buf);
+    }
+    {  // constant strings appended past the initial wbuf, which grows and is accounted for
+      assert(write(fds[4], "many\n", 5) == 5);
+      int size = 5 + 10000, n = 0;
+      byte *buf = (byte *)MALLOC(size);
+      while (n < size) {
+        int r = read(fds[4], buf + n, size - n);
+        assert(r > 0);
+        n += r;
+      }
+      assert(!memcmp(buf, "many\n", 5) && !memcmp(buf + 5 + 9990, "0123456789", 10));
+      for (int i = 0; i < 1000 && __atomic_load_n(&f.write_queued, __ATOMIC_RELAXED); i++) wait_for(HRTIME_MSEC);
+      assert(!__atomic_load_n(&f.write_queued, __ATOMIC_RELAXED));
+      FREE(buf);
+    }
+    {  // file segment between memory, sent with sendfile()
+      assert(write(fds[2], "file\n", 5) == 5);
+      int size = 5 + sizeof(test_conn_data) - 7 + 4, n = 0;
+      byte *buf = (byte *)MALLOC(size);
+      wait_for(HRTIME_MSEC * 10);
+      while (n < size) {
+        int r = read(fds[2], buf + n, size - n);
+        assert(r > 0);
+        n += r;
+      }
+      assert(!memcmp(buf, "file\n", 5) && !memcmp(buf + 5, test_conn_data + 7, sizeof(test_conn_data) - 7));
+      assert(!memcmp(buf + size - 4, "end\n", 4));
+      FREE(buf);
+    }
+    {  // header block arriving in pieces, tokenized in place
+      char v[6001];
+      memset(v, 'v', 6000);
+      v[6000] = 0;
+      cchar *parts[] = {"headers\nHo", "st: x\r\nX-Long:", v, "\r\ncontent-length:  12 \r", "\n\r", "\n"};
+      for (int i = 0; i < (int)numberof(parts); i++) {
+        assert(write(fds[3], parts[i], strlen(parts[i])) == (int)strlen(parts[i]));
+        wait_for(HRTIME_MSEC);
+      }
+      char buf[64];
+      cchar *expect = "headers\n3 12 6000\n";
+      int n = 0, l = strlen(expect);
+      while (n < l) {
+        int r = read(fds[3], buf + n, sizeof(buf) - n);
+        assert(r > 0);
+        n += r;
+      }
+      assert(n == l && !memcmp(buf, expect, l));
+    }
+    for (int i = 0; i < TEST_CONN_CLIENTS; i++) ::close(fds[i]);
+    f.stop();
+  }
+  // conns left open are closed with the factory: one thread, running one conn with another queued,
+  // the same work stealing, then idle on epoll and io_uring reactors
+  for (int mode = 0; mode < 4; mode++) {
+    int fds[2];
+    {
+      TestConnFactory f;
+      f.thread_pool.maxthreads = 1;
+      f.thread_pool.work_stealing = mode == 1;
+      f.nreactors = mode >= 2 ? 1 : 0;
+      f.io_uring = mode == 3;
+      f.port = 0;
+      assert(!f.start());
+      for (int i = 0; i < 2; i++) {
+        fds[i] = connect_socket(inet_addr("127.0.0.1"), f.port);
+        assert(fds[i] >= 0 && write(fds[i], "hello\n", 6) == 6);
+      }
+      wait_for(HRTIME_MSEC * 10);  // accepted, and in mode 0 and 1 one of them running
+    }
+    for (int i = 0; i < 2; i++) {
+      char buf[16];
+      int r;
+      while ((r = read(fds[i], buf, sizeof(buf))) > 0) {
+      }
+      assert(r == 0 || errno == ECONNRESET);
+      ::close(fds[i]);
+    }
+  }
+  ::close(test_conn_file);
+  printf("conn test\tPASSED\n");
+}
+#endif
@@ -6,14 +6,36 @@
 
 #define DEFAULT_FACTORY_THREADS 100
 #define DEFAULT_FACTORY_STACKSIZE 0  // default
-#define DEFAULT_IOBUF_SIZE 512000
+#define DEFAULT_FACTORY_MINTHREADS 4
+#define DEFAULT_FACTORY_IDLE_TIMEOUT 30000  // msec
+#define DEFAULT_FACTORY_SPAWN_DELAY 50      // usec
+#define DEFAULT_IOBUF_SIZE 512000  // largest rbuf, buffers start at IOBUF_SMALL and grow
+#define DEFAULT_FACTORY_REACTORS 0  // event loop threads, 0 for a thread per connection
+#define DEFAULT_FACTORY_ACCEPTORS 1  // accept threads without reactors
+#define DEFAULT_FACTORY_WRITE_HIGH 0    // bytes queued on a connection before it is throttled, 0 for no limit
+#define DEFAULT_FACTORY_WRITE_BUDGET 0  // MB queued on all connections, 0 for no limit
+#define DEFAULT_REACTOR_IOBUF_SIZE 16384
+#define REACTOR_MAX_EVENTS 256
+#define DEFAULT_REACTOR_URING_ENTRIES 1024
+#define DEFAULT_REACTOR_URING_BUFFERS 256  // registered buffers per reactor, each iobuf_size
+#define REACTOR_URING_MAX_FILES 65536      // registered file slots, fd is the slot
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#define CONN_IOV_INITIAL 8             // iovec entries, doubled up to IOV_MAX
+#define CONN_SENDFILE_CHUNK (1 << 30)  // bytes per sendfile() or splice()
+#define CONN_MAX_HEADERS 64            // header lines in a HeaderIndex
+#define CONN_DATE_SIZE 32              // an HTTP date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT", and a 0
+
+// I/O buffer size classes, larger buffers are allocated directly
+#define IOBUF_SMALL 4096
+#define IOBUF_MEDIUM 32768
+#define IOBUF_LARGE 524288
+#define IOBUF_CLASSES 3
+#define IOBUF_POOL_CACHED (16 << 20)  // bytes of free buffers kept per class
 
 #define APPEND_STRING(_s) append_string(_s "", sizeof(_s) - 1)
-#define APPEND_TO_BUF(_b, _s)              \
-  do {                                     \
-    memcpy(_b.end, _s "", sizeof(_s) - 1); \
-    _b.end += sizeof(_s) - 1;              \
-  } while (0)
+#define APPEND_TO_BUF(_b, _s) append_to_buf_n(_b, (const byte *)_s "", sizeof(_s) - 1)
 #define ALLOC_STRING(_s) alloc_str(_s, sizeof(_s) - 1)
 #define LINECMP(_const_string) \
   (((int)sizeof(_const_string "")) - 1 > rbuf.line_len() || STRCMP(rbuf.line, _const_string))
@@ -26,13 +48,28 @@
   while ((_p) < rbuf.cur && isspace(*(_p))) (_p)++;
 #define LINEPSKIP(_p, _const_string) ((_p) += ((int)sizeof(_const_string "") - 1))
 
+#define BUFFER_POOLED 1  // chain segment from Conn::add_buffer(), returned to the pool once written
+#define BUFFER_OWNED 2   // the segment's memory is from the I/O buffer pool, freed with it
+#define BUFFER_FILE 4    // the segment is bytes [cur, end) of fd, cur and end are file offsets
+
+/*
+  The write buffer may be followed by a chain of segments through next,
+  written in order by put() and flush() which advance cur across the chain,
+  so a short write never resends or drops data.  Appends which don't fit
+  go on to new segments of growing size rather than a larger buffer.  File
+  segments are sent from the file by the kernel (sendfile() or splice())
+  without being copied through user memory.
+*/
 struct buffer_t {
   byte *buf;
   byte *cur;
   byte *end;
   byte *bufend;
   byte *line;
+  byte *scan;  // rbuf: no '\n' in [cur, scan), so a partial line is only scanned once
   struct buffer_t *next;
+  int flags;
+  int fd;  // BUFFER_FILE
 
   int rlen() { return end - cur; }
   int wlen() { return bufend - end; }
@@ -40,18 +77,117 @@ struct buffer_t {
   int line_len() { return cur - line; }
   int empty_line() { return (line[0] == '\r' && line[1] == '\n') || line[0] == '\n'; }
 
-  void reset() { cur = end = buf; }
+  void reset() { cur = end = scan = buf; }
 };
 
 int str_len(cchar *s);
 
+// vectorized (AVX2 or SSE2 if compiled for it) search for line ends
+byte *scan_line(byte *p, byte *e);                   // the first '\n' in [p, e), 0 if none
+int scan_lines(byte *p, byte *e, int *nl, int max);  // offsets from p of up to max '\n's, returns the count
+
+// a "name: value" header line, offsets from HeaderIndex::base, the value without surrounding space
+struct header_t {
+  int name, name_len;
+  int value, value_len;
+};
+
+/*
+  Header lines up to and including an empty line, tokenized in place in
+  rbuf by Conn::get_headers() and try_get_headers().  Lines are found with
+  scan_lines() as they arrive, so a block spread over several reads is
+  scanned once, and nothing is copied: base points at the first line in
+  rbuf and is only good until the next read.  clear() before each block.
+*/
+class HeaderIndex {
+ public:
+  byte *base;  // set when the block is complete
+  int n;
+  int line, scanned;  // offsets from rbuf.cur while incomplete
+  header_t h[CONN_MAX_HEADERS];
+
+  void clear() { base = 0, n = line = scanned = 0; }
+  int add(byte *b, int start, int end);  // the line [start, end) of b, -1 if it isn't a header or too many
+  int find(cchar *name, int len);        // case insensitive, -1 if not present
+  int find(cchar *name) { return find(name, strlen(name)); }
+  byte *name(int i) { return base + h[i].name; }
+  byte *value(int i) { return base + h[i].value; }
+
+  HeaderIndex() { clear(); }
+};
+#define HEADER_FIND(_h, _const_string) (_h).find(_const_string, sizeof(_const_string "") - 1)
+
+// shared free lists of I/O buffers, one per size class
+class IOBufferPool {
+ public:
+  struct Class {
+    alignas(64) pthread_mutex_t mutex;
+    byte **free;
+    int count, max;
+  } classes[IOBUF_CLASSES];
+
+  byte *alloc(int &size);  // size is rounded up to its class
+  void free(byte *b, int size);
+  static int size_class(int size) {
+    return size <= IOBUF_SMALL ? 0 : size <= IOBUF_MEDIUM ? 1 : size <= IOBUF_LARGE ? 2 : -1;
+  }
+  static int class_size(int c) { return c == 0 ? IOBUF_SMALL : c == 1 ? IOBUF_MEDIUM : IOBUF_LARGE; }
+
+  IOBufferPool();
+};
+
+extern IOBufferPool iobuf_pool;
+
 class ConnFactory;
+class Reactor;
+
+/*
+  A connection runs either as a ThreadPool job, where main() uses the
+  blocking get_*() and put*() calls, or on a Reactor, where ready() is called
+  on the reactor thread with the epoll events whenever the socket becomes
+  readable or writable and uses the non-blocking try_get_*(), read_some() and
+  flush() calls.  Readiness is edge triggered, so ready() must go on until a
+  call returns 0 (would block) or the connection is finished, and returns -1
+  to have the reactor close it.  On a reactor the buffers are allocated on
+  demand and released while the connection is idle.
+
+  Buffers come from the I/O buffer pool and start small.  When rbuf fills
+  up, unconsumed data (from rbuf.cur) is moved down or into a larger buffer,
+  up to rbuf_size, so pointers into data before rbuf.cur (e.g. earlier lines)
+  are only good until the next read.  A blocking connection waiting for its
+  next request in get_line() goes back to a small buffer.
+
+  On an io_uring reactor read_some() and flush() submit the I/O and return 0
+  and 1, and ready() is called again when it completes, so the same ready()
+  works for both.  The connection must not reset_wbuf() while flush() is
+  pending and must only be closed by returning -1 (or done()).
 
+  Backpressure: when more than write_high bytes of memory are queued to be
+  written, or the factory's queues together exceed its write budget, the
+  connection is throttled until its own queue drains to write_low.  While
+  throttled try_get_*() return 0 as if there were no input, so a reactor
+  connection stops taking requests until the client reads its responses,
+  and get_line() writes out the queue before reading.  write_throttled()
+  is called on each change.
+*/
 class Conn : public ThreadPoolJob {
  public:
   int ifd, ofd;
   ConnFactory *factory;
+  Reactor *reactor;  // 0 if run as a job
   buffer_t rbuf, wbuf;
+  int rbuf_size, wbuf_size;
+  struct iovec *iov;  // for writing wbuf chains, reused
+  int iov_size;
+  int pipefd[2];  // for splice() when sendfile() can't be used, -1 until needed
+  int piped;      // bytes from the chain in the pipe, written before the rest
+  int uring_flags;   // io_uring reactor: CONN_URING_*
+  byte *uring_recv;  // where the pending read goes, rbuf.end when submitted
+  struct msghdr uring_msg;
+  int64 wqueued;              // bytes of memory in the unwritten chain
+  int write_high, write_low;  // watermarks, 0 for none
+  int throttled;
+  LINK(Conn, conn_link);  // in the open conns of its reactor, or of its factory if run as a job
 
   char *alloc_str(char *s, int l = 0) {
     if (!l) l = strlen(s);
@@ -61,17 +197,28 @@ class Conn : public ThreadPoolJob {
   }
   char *alloc_xml_value(char *s, char *e, char **r);
   char *alloc_date_str();
+  int append_date();  // the date, as from copy_date_str(), to wbuf
 
   int get_line();
+  int get_headers(HeaderIndex &h);  // 0 when the block is complete, -1 on error
   int get(int n);
   int get_some();
 
-  int append_to_buf(buffer_t &b, cchar *s) {
-    b.end = (byte *)scpy((char *)b.end, s);
-    assert(b.end <= b.bufend);
-    return 0;
+  // non-blocking: return > 0 on success, 0 if it would block, -1 on error, eof or full buffer
+  virtual int ready(int events) {
+    assert(!"no ready();");
+    return -1;
   }
+  virtual void write_throttled(int on) {}  // backpressure started (1) or ended (0)
+  int read_some();
+  int try_get_line();
+  int try_get_headers(HeaderIndex &h);
+  int try_get(int n);
+  int flush();  // 0 when written, 1 if still pending, -1 on error
+
+  int append_to_buf(buffer_t &b, cchar *s) { return append_to_buf_n(b, (const byte *)s, strlen(s)); }
   int append_to_buf_n(buffer_t &b, const byte *s, int n) {
+    if (&b == &wbuf) return append_wbuf(s, n);
     memcpy(b.end, s, n);
     b.end += n;
     assert(b.end <= b.bufend);
@@ -106,19 +253,159 @@ class Conn : public ThreadPoolJob {
     return put();
   }
   int put();
+  // queue len bytes at buf after what is already queued, buf must stay valid until written
+  void add_buffer(byte *buf, int len);
+  int append_wbuf(const byte *s, int n);  // to the end of the chain, adding segments as needed
+  // queue len bytes of fd from offset, fd must stay open until written
+  void add_file(int fd, int64 offset, int64 len);
+  int put_file(int fd, int64 offset, int64 len) {
+    add_file(fd, offset, len);
+    return put();
+  }
+  buffer_t *unwritten() {  // the first segment with data left, 0 if none
+    buffer_t *b = &wbuf;
+    while (b && b->cur == b->end) b = b->next;
+    return b;
+  }
+  int write_some();  // the start of the chain, returns bytes written, 0 when all is written, -1 on error
+  int send_file(buffer_t *b);
+  int fill_iov();          // iov for the unwritten part of the chain up to a file, returns the count
+  void consumed(int64 n);  // n bytes of the chain written
+  void wqueue(int64 n);    // account for n bytes queued (or written if negative)
+  void release_chain();
 
   void reset_rbuf() { rbuf.reset(); }
-  void reset_wbuf() { wbuf.reset(); }
+  void reset_wbuf() {
+    wbuf.reset();
+    if (!wbuf.next) wqueue(-wqueued);
+  }
   void check_rbuf();  // move data to top of the buffer
 
   int error(cchar *errlogmsg = 0);
   virtual int done();
+  void close_fds();
   virtual void free();
-  void init(int rbuf_size = DEFAULT_IOBUF_SIZE, int wbuf_size = DEFAULT_IOBUF_SIZE);
+  void unlink_conn();  // from the open conns, before its fds are closed
+  void init(int rbuf_size = DEFAULT_IOBUF_SIZE, int wbuf_size = DEFAULT_IOBUF_SIZE);  // largest buffers
+  void alloc_buffers();
+  void release_buffers();  // those which have been drained
+  byte *alloc_iobuf(int &size);
+  void free_iobuf(byte *b, int size);
+  int make_room();  // in rbuf after end, -1 if rbuf_size is full
+  byte *next_line() {  // the '\n' ending the line at rbuf.cur, 0 if it hasn't all been read
+    byte *p = rbuf.scan > rbuf.cur && rbuf.scan <= rbuf.end ? rbuf.scan : rbuf.cur;
+    byte *x = scan_line(p, rbuf.end);
+    rbuf.scan = x ? x : rbuf.end;
+    return x;
+  }
+  int scan_headers(HeaderIndex &h);  // 1 when complete, 0 if more is needed, -1 on a bad line
 
   Conn();
+  virtual ~Conn() {}
+};
+
+#define CONN_URING_READ 1      // recv in flight
+#define CONN_URING_POLL 2      // waiting for input with no buffer
+#define CONN_URING_WRITE 4     // send in flight
+#define CONN_URING_EOF 8       // end of input or read error
+#define CONN_URING_ERROR 16    // write error
+#define CONN_URING_FIXED 32    // ifd is a registered file slot
+#define CONN_URING_CLOSING 64  // closed once nothing is in flight
+#define CONN_URING_PENDING (CONN_URING_READ | CONN_URING_POLL | CONN_URING_WRITE)
+
+// event loop, one thread, which accepts connections and calls their ready()
+class Reactor {
+ public:
+  ConnFactory *factory;
+  pthread_t thread;
+  int completions;  // read_some() and flush() are submitted to the reactor
+  int listen_fd;    // the factory's, or with reuseport the reactor's own
+  int cpu;          // pinned to, -1 for none
+  DList(Conn, conn_link) conns;  // open, only used by the reactor thread, closed when it stops
+
+  virtual void run() = 0;
+  virtual void wake() = 0;  // from another thread, e.g. to notice stopping
+  virtual int read_some(Conn *c) { return -1; }
+  virtual int flush(Conn *c) { return -1; }
+  virtual void remove(Conn *c) {}  // before the connection's fds are closed
+  virtual byte *alloc_buffer(int &size) { return iobuf_pool.alloc(size); }
+  virtual void free_buffer(byte *b, int size) { iobuf_pool.free(b, size); }
+
+  Reactor(ConnFactory *afactory, int alisten_fd)
+      : factory(afactory), thread(0), completions(0), listen_fd(alisten_fd), cpu(-1) {}
+  virtual ~Reactor() {}
+};
+
+// edge triggered epoll
+class EpollReactor : public Reactor {
+ public:
+  int epfd, wakefd;
+
+  int add(Conn *c);
+  void accept_conns();
+  void run();
+  void wake();
+
+  EpollReactor(ConnFactory *afactory, int alisten_fd);
+  ~EpollReactor();
 };
 
+#ifdef HAVE_IO_URING
+/*
+  io_uring: accept is one multishot SQE, reads and writes are submitted
+  against registered file slots and reads go into registered buffers when
+  the connection's buffer comes from the reactor's pool.  A connection with
+  nothing buffered waits for input with a poll rather than holding a buffer
+  in a pending read.
+*/
+class UringReactor : public Reactor {
+ public:
+  Uring ring;
+  int wakefd;
+  uint64 wakeval;
+  int files;      // registered file slots, 0 for none
+  int multishot;  // accept with IORING_ACCEPT_MULTISHOT
+  byte *pool;     // registered buffers, buffer_size each, 0 for none
+  int buffer_size, nbuffers;
+  Vec<byte *> free_buffers;
+
+  int init();  // -1 if io_uring is unavailable
+  void arm_accept();
+  void arm_wake();
+  void accepted(int fd);
+  void completed(Conn *c, int op, int res);
+  void close(Conn *c);
+  void submit_recv(Conn *c);
+  struct io_uring_sqe *conn_sqe(Conn *c, int op);
+  void run();
+  void wake();
+  int read_some(Conn *c);
+  int flush(Conn *c);
+  void remove(Conn *c);
+  byte *alloc_buffer(int &size);
+  void free_buffer(byte *b, int size);
+
+  UringReactor(ConnFactory *afactory, int alisten_fd);
+  ~UringReactor();
+};
+#endif
+
+// an accept thread, adding connections to the factory's thread pool
+struct ConnAcceptor {
+  ConnFactory *factory;
+  int fd;
+  int cpu;  // pinned to, -1 for none
+  pthread_t thread;
+};
+
+/*
+  Listening: by default one socket is shared by the accept thread(s) or
+  polled by all the reactors.  With reuseport each acceptor, or each
+  reactor, listens on its own SO_REUSEPORT socket on the port, so the
+  kernel spreads connections across them and they don't contend for a
+  single accept queue.  With acceptor_cpus the acceptor or reactor threads
+  are pinned round robin to those cpus.
+*/
 class ConnFactory {
  public:
   cchar *name;
@@ -128,9 +415,42 @@ class ConnFactory {
   int stacksize;
   ThreadPool thread_pool;
   pthread_mutex_t lock;
-  FreeList *conn_freelist;
+  ConcurrentFreeList *conn_freelist;  // owned, set by pool_conns(), Conn::free() destroys conns into it
+  DList(Conn, conn_link) conns;       // open and run on thread_pool, under lock
+  int nreactors;      // event loop threads, 0 for a thread per connection on thread_pool
+  int iobuf_size;     // 0 for the default of the mode
+  int io_uring;       // reactors use io_uring where the kernel allows it, else epoll
+  int uring_buffers;  // registered buffers per io_uring reactor
+  int write_high;     // per connection, see Conn
+  int write_low;      // 0 for write_high / 2
+  int write_budget;   // MB, all connections
+  int64 write_queued;
+  int acceptors;         // accept threads without reactors
+  int reuseport;         // a listening socket per acceptor or reactor
+  cchar *acceptor_cpus;  // cpulist (e.g. "0-3") for acceptor or reactor threads, 0 for no pinning
+  Reactor **reactors;
+  ConnAcceptor *acceptor;
+  Vec<int> listen_fds;  // fd, then with reuseport the others
+  volatile int stopping;
+
+  virtual Conn *new_conn() { return 0; }  // an unused Conn, returned by its free()
+  // new_conn() may construct conns of type C with pooled_conn<C>(args) after pool_conns<C>() in the constructor
+  template <class C>
+  void pool_conns() {
+    conn_freelist = new ConcurrentObjectFreeList<C>;
+  }
+  template <class C, class... Args>
+  C *pooled_conn(Args &&...args) {
+    return ((ConcurrentObjectFreeList<C> *)conn_freelist)->alloc(std::forward<Args>(args)...);
+  }
+  Conn *accepted(int fd, Reactor *r);
+  int start();  // listen on port and accept connections
+  int listen_socket(int i);  // the i'th listening socket, the first sets fd (and port if 0)
+  void stop();  // stop accepting, reactors close their conns as they stop, those run as jobs are left open
+  void close_conns();  // close those run as jobs: running ones see end of input, queued ones are taken back
 
   ConnFactory(cchar *aname);
+  virtual ~ConnFactory();  // stops and closes all conns before the freelist goes
 };
 
 class Server : public ConnFactory {
@@ -138,18 +458,21 @@ class Server : public ConnFactory {
   Server(cchar *aname);
 };
 
-void add_string_buffer(Vec<buffer_t> &bufs, char *str, int len);
+void add_string_buffer(Vec<buffer_t> &bufs, byte *buf, int len);
+void test_conn();
 void copy_str_to_buf(char *s, char *dest, int *dest_len);  // dest_len read for limit and set
+int copy_date_str(char *buf);  // the HTTP date now into buf (CONN_DATE_SIZE), returns the length, lock-free
 
 // INLINE FUNCTIONS
 
 inline int str_len(char *s) { return *(int *)(s - sizeof(int)); }
 
 inline void Conn::check_rbuf() {
-  int l = rbuf.end - rbuf.cur;
+  int l = rbuf.end - rbuf.cur, s = rbuf.scan > rbuf.cur ? rbuf.scan - rbuf.cur : 0;
   if (l && rbuf.cur != rbuf.buf) memmove(rbuf.buf, rbuf.cur, l);
   rbuf.end = rbuf.buf + l;
   rbuf.cur = rbuf.buf;
+  rbuf.scan = rbuf.buf + s;
 }
 
 inline void copy_str_to_buf(char *s, char *dest, int *dest_len) {
@@ -0,0 +1,234 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#include "plib.h"
+
+typedef MapElem<uint64, ConnPoolHost *> ConnPoolHostElem;
+
+static cchar *conn_pool_stat_names[CONN_POOL_STATS] = {"hits", "misses", "failed", "stale", "evicted"};
+
+int ClientConn::done() {
+  close_fds();
+  ifd = ofd = -1;
+  Conn::free();
+  delete this;
+  return 0;
+}
+
+// the peer closed the connection or sent something unasked while it was idle
+static int stale(int fd) {
+  char c;
+  int r = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return r >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+ConnPool::ConnPool(cchar *aname)
+    : name(aname),
+      max_idle(DEFAULT_CONN_POOL_MAX_IDLE),
+      idle_timeout(DEFAULT_CONN_POOL_IDLE_TIMEOUT),
+      iobuf_size(DEFAULT_CONN_POOL_IOBUF_SIZE),
+      nodelay(1),
+      nidle(0),
+      last_evict(0) {
+  pthread_mutex_init(&mutex, 0);
+  memset((void *)stat, 0, sizeof(stat));
+  if (name) {
+    char n[256];
+    for (int i = 0; i < CONN_POOL_STATS; i++) {
+      snprintf(n, sizeof(n), "%s.%s", name, conn_pool_stat_names[i]);
+      register_global_stat(n, stat[i]);
+    }
+  }
+}
+
+ConnPool::~ConnPool() {
+  form_Map(ConnPoolHostElem, x, hosts) {
+    while (ClientConn *c = x->value->idle.pop()) c->done();
+    delete x->value;
+  }
+  if (name)
+    for (int i = 0; i < CONN_POOL_STATS; i++) unregister_global_stat(stat[i]);
+  pthread_mutex_destroy(&mutex);
+}
+
+ClientConn *ConnPool::get(in_addr_t addr, int port) {
+  uint64 key = ((uint64)addr << 16) | (uint16)port;
+  pthread_mutex_lock(&mutex);
+  ConnPoolHost *h = hosts.get(key);
+  while (h && h->idle.tail) {
+    ClientConn *c = h->idle.tail;  // the most recently used
+    h->idle.remove(c);
+    h->nidle--;
+    nidle--;
+    if (!stale(c->ifd)) {
+      pthread_mutex_unlock(&mutex);
+      GSTAT_INC(stat[CONN_POOL_STAT_HITS]);
+      c->alloc_buffers();  // released while idle
+      return c;
+    }
+    GSTAT_INC(stat[CONN_POOL_STAT_STALE]);
+    c->done();
+  }
+  pthread_mutex_unlock(&mutex);
+  int fd = connect_socket(addr, port, 0, nodelay);
+  if (fd < 0) {
+    GSTAT_INC(stat[CONN_POOL_STAT_FAILED]);
+    return 0;
+  }
+  GSTAT_INC(stat[CONN_POOL_STAT_MISSES]);
+  ClientConn *c = new ClientConn(this, key);
+  c->ifd = c->ofd = fd;
+  c->init(iobuf_size, iobuf_size);
+  return c;
+}
+
+void ConnPool::put(ClientConn *c) {
+  if (!c->reusable()) {
+    c->done();
+    return;
+  }
+  c->release_buffers();
+  hrtime_t now = hrtime();
+  c->idle_since = now;
+  pthread_mutex_lock(&mutex);
+  ConnPoolHost *h = hosts.get(c->key);
+  if (!h) {
+    h = new ConnPoolHost;
+    hosts.put(c->key, h);
+  }
+  h->idle.enqueue(c);
+  h->nidle++;
+  nidle++;
+  ClientConn *over = 0;
+  if (h->nidle > max_idle) {
+    over = h->idle.dequeue();  // the least recently used
+    h->nidle--;
+    nidle--;
+  }
+  int check = idle_timeout && now - last_evict > HRTIME_SEC;
+  pthread_mutex_unlock(&mutex);
+  if (over) {
+    GSTAT_INC(stat[CONN_POOL_STAT_EVICTED]);
+    over->done();
+  }
+  if (check) evict(now);
+}
+
+int ConnPool::evict(hrtime_t now) {
+  if (!idle_timeout) return 0;
+  if (!now) now = hrtime();
+  hrtime_t oldest = now - (hrtime_t)idle_timeout * HRTIME_MSEC;
+  Que(ClientConn, pool_link) expired;
+  int n = 0;
+  pthread_mutex_lock(&mutex);
+  last_evict = now;
+  form_Map(ConnPoolHostElem, x, hosts) {
+    ConnPoolHost *h = x->value;
+    while (h->idle.head && h->idle.head->idle_since <= oldest) {
+      expired.push(h->idle.dequeue());
+      h->nidle--;
+      nidle--;
+      n++;
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+  while (ClientConn *c = expired.pop()) c->done();
+  if (n) GSTAT_ADD(stat[CONN_POOL_STAT_EVICTED], n);
+  return n;
+}
+
+double ConnPool::hit_rate() {
+  int64 hits = __atomic_load_n(&stat[CONN_POOL_STAT_HITS].count, __ATOMIC_RELAXED);
+  int64 misses = __atomic_load_n(&stat[CONN_POOL_STAT_MISSES].count, __ATOMIC_RELAXED);
+  return hits + misses ? (double)hits / (hits + misses) : 0.0;
+}
+
+#ifdef TEST_LIB
+class TestEchoConn final : public Conn {  // answers each line with "<n>:<line>", n counting from 1
+ public:
+  int main() {
+    int n = 0;
+    while (!get_line()) {
+      append_print("%d:", ++n);
+      append_string((char *)rbuf.line, rbuf.line_len());
+      if (put()) break;
+    }
+    done();
+    return 0;
+  }
+  void free() {
+    Conn::free();
+    delete this;
+  }
+};
+
+class TestEchoFactory : public ConnFactory {
+ public:
+  Conn *new_conn() { return new TestEchoConn; }
+  TestEchoFactory() : ConnFactory("test_connpool") {}
+};
+
+static int test_connpool_line(ClientConn *c, cchar *expect) {
+  if (c->get_line()) return -1;
+  c->received();
+  return c->rbuf.line_len() == (int)strlen(expect) && !memcmp(c->rbuf.line, expect, strlen(expect)) ? 0 : -1;
+}
+
+void test_connpool() {
+  TestEchoFactory f;
+  f.port = 0;
+  assert(!f.start());
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  getsockname(f.fd, (struct sockaddr *)&addr, &len);
+  int port = ntohs(addr.sin_port);
+  in_addr_t localhost = inet_addr("127.0.0.1");
+  {
+    ConnPool p("test_connpool");
+    p.max_idle = 2;
+    ClientConn *c = p.get(localhost, port);
+    assert(c);
+    // pipelined: both requests in one write, responses in order
+    c->append_string("a\nb\n");
+    c->sent(2);
+    assert(!c->put());
+    assert(!test_connpool_line(c, "1:a\n") && !c->reusable());
+    assert(!test_connpool_line(c, "2:b\n") && c->reusable());
+    p.put(c);
+    ClientConn *d = p.get(localhost, port);  // the same connection, warm
+    assert(d == c && p.hit_rate() == 0.5);
+    d->PUT_STRING("c\n");
+    d->sent();
+    assert(!test_connpool_line(d, "3:c\n"));
+    // more than max_idle: the least recently used is closed
+    ClientConn *e = p.get(localhost, port), *g = p.get(localhost, port);
+    assert(e && g && e != d && g != d);
+    p.put(d);
+    p.put(e);
+    p.put(g);
+    assert(p.nidle == 2 && p.stat[CONN_POOL_STAT_EVICTED].count == 1);
+    assert(p.get(localhost, port) == g);
+    p.put(g);
+    // a response left unread: not reused
+    g = p.get(localhost, port);
+    g->PUT_STRING("x\n");
+    g->sent();
+    p.put(g);
+    assert(p.nidle == 1);
+    // closed while idle
+    e = p.get(localhost, port);
+    ::shutdown(e->ifd, SHUT_RDWR);
+    wait_for(HRTIME_MSEC * 10);
+    p.put(e);
+    g = p.get(localhost, port);
+    assert(g && p.stat[CONN_POOL_STAT_STALE].count == 1);
+    g->PUT_STRING("y\n");
+    g->sent();
+    assert(!test_connpool_line(g, "1:y\n"));  // a new connection
+    p.put(g);
+    assert(p.evict(hrtime() + (hrtime_t)p.idle_timeout * HRTIME_MSEC) == 1 && !p.nidle);
+  }
+  f.stop();
+  printf("connpool test\tPASSED\n");
+}
+#endif
@@ -0,0 +1,89 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#ifndef _connpool_H_
+#define _connpool_H_
+
+#define DEFAULT_CONN_POOL_MAX_IDLE 16         // idle connections kept per host
+#define DEFAULT_CONN_POOL_IDLE_TIMEOUT 60000  // msec
+#define DEFAULT_CONN_POOL_IOBUF_SIZE 512000   // largest buffers
+
+#define CONN_POOL_STAT_HITS 0     // get() reused an idle connection
+#define CONN_POOL_STAT_MISSES 1   // get() connected
+#define CONN_POOL_STAT_FAILED 2   // connect() failed
+#define CONN_POOL_STAT_STALE 3    // idle connections found closed or with unexpected input
+#define CONN_POOL_STAT_EVICTED 4  // closed by put() over max_idle or idle longer than idle_timeout
+#define CONN_POOL_STATS 5
+
+class ConnPool;
+
+/*
+  A client connection from a ConnPool, used with the blocking Conn calls.
+  Requests may be pipelined: append several, put() them and read the
+  responses in order, counting them with sent() and received() so that the
+  pool only reuses a connection with nothing outstanding.  Return it with
+  ConnPool::put() or close it with done() (e.g. by error()).
+*/
+class ClientConn : public Conn {
+ public:
+  ConnPool *pool;
+  uint64 key;
+  hrtime_t idle_since;
+  int pending;  // requests sent whose responses haven't been read
+  LINK(ClientConn, pool_link);
+
+  void sent(int n = 1) { pending += n; }
+  void received(int n = 1) { pending -= n; }
+  int reusable() { return !pending && rbuf.cur == rbuf.end && !wbuf.next && wbuf.cur == wbuf.end; }
+  int done();
+
+  ClientConn(ConnPool *apool, uint64 akey) : pool(apool), key(akey), idle_since(0), pending(0) {}
+  virtual ~ClientConn() {}
+};
+
+class ConnPoolHashFns {
+ public:
+  static uintptr_t hash(uint64 k) { return (uintptr_t)(k * 0x9E3779B97F4A7C15ULL >> 16); }
+  static int equal(uint64 a, uint64 b) { return a == b; }
+};
+
+struct ConnPoolHost {
+  Que(ClientConn, pool_link) idle;  // least recently used first
+  int nidle;
+
+  ConnPoolHost() : nidle(0) {}
+};
+
+/*
+  Warm client connections keyed by address and port.  get() takes the most
+  recently used idle connection to the host, dropping any the peer has
+  closed meanwhile, and only connects when there is none.  Connections idle
+  longer than idle_timeout are closed by evict(), which put() runs at most
+  once a second.  Hit rates are kept as global stats "<name>.hits" etc. if
+  the pool is named.
+*/
+class ConnPool {
+ public:
+  pthread_mutex_t mutex;
+  cchar *name;
+  int max_idle;      // per host
+  int idle_timeout;  // msec, 0 for never
+  int iobuf_size;
+  int nodelay;
+  HashMap<uint64, ConnPoolHashFns, ConnPoolHost *> hosts;
+  int nidle;
+  hrtime_t last_evict;
+  Stat stat[CONN_POOL_STATS];
+
+  ClientConn *get(in_addr_t addr, int port);  // 0 if it can't connect
+  void put(ClientConn *c);                    // for reuse, closed if it isn't reusable
+  int evict(hrtime_t now = 0);                // closes those idle too long, returns the count
+  double hit_rate();
+
+  ConnPool(cchar *aname = 0);
+  ~ConnPool();
+};
+
+void test_connpool();
+
+#endif
@@ -4285,6 +4285,14 @@ void mspace_set_morecore_pfn(mspace msp, morecore_pfn_t amorecore_pfn) {
 
 mspace mspace_from_base(void *base) { return (mspace)chunk2mem(base); }
 
+size_t mspace_usable_size(void *mem) {
+  if (mem != 0) {
+    mchunkptr p = mem2chunk(mem);
+    if (cinuse(p)) return chunksize(p) - overhead_for(p);
+  }
+  return 0;
+}
+
 size_t destroy_mspace(mspace msp) {
   size_t freed = 0;
   mstate ms = (mstate)msp;
@@ -4597,22 +4605,24 @@ void mspace_malloc_stats(mspace msp) {
 }
 
 size_t mspace_footprint(mspace msp) {
-  size_t result;
+  size_t result = 0;
   mstate ms = (mstate)msp;
   if (ok_magic(ms)) {
     result = ms->footprint;
+  } else {
+    USAGE_ERROR_ACTION(ms, ms);
   }
-  USAGE_ERROR_ACTION(ms, ms);
   return result;
 }
 
 size_t mspace_max_footprint(mspace msp) {
-  size_t result;
+  size_t result = 0;
   mstate ms = (mstate)msp;
   if (ok_magic(ms)) {
     result = ms->max_footprint;
+  } else {
+    USAGE_ERROR_ACTION(ms, ms);
   }
-  USAGE_ERROR_ACTION(ms, ms);
   return result;
 }
 
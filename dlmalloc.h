@@ -448,6 +448,7 @@ void *mspace_get_morecore_ptr(mspace msp);
 void mspace_set_morecore_ptr(mspace msp, void *p);
 void mspace_set_morecore_pfn(mspace msp, morecore_pfn_t morecore_pfn);
 mspace mspace_from_base(void *base);
+size_t mspace_usable_size(void *mem);  // as malloc_usable_size, for memory from any mspace
 
 /*
   mspace_malloc behaves as malloc, but operates within
@@ -6,6 +6,8 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <new>
+#include <utility>
 
 #ifdef __APPLE__
 #define _XOPEN_SOURCE 600
@@ -14,17 +16,20 @@
 #endif
 
 // alignment must be a power of 2 greater than 8
+// trim() returns blocks with no objects in use, keeping retain of them for the next spike
 
 class FreeList {
  public:
   int size, count, alignment;
   int active, allocated;
+  int retain;  // free blocks kept by trim()
   void *head;
   void *block_head;
 
   void *alloc();
   void free(void *ptr);
   void xpand();
+  int64_t trim();  // returns the bytes released
   void init(int asize, int acount = 64, int aalignment = 16);
   void x();
 
@@ -32,6 +37,7 @@ class FreeList {
   ~FreeList();
 };
 
+// objects are copied from protoObject, for plain types which don't mind not being constructed
 template <class C>
 class ClassFreeList : public FreeList {
  public:
@@ -42,11 +48,29 @@ class ClassFreeList : public FreeList {
   ClassFreeList(int acount = 64, int aalignment = 16) : FreeList(sizeof(C), acount, aalignment) {}
 };
 
+// alloc() constructs with the given arguments, free() destroys
+template <class C>
+class ObjectFreeList : public FreeList {
+ public:
+  template <class... Args>
+  C *alloc(Args &&...args) {
+    return new (FreeList::alloc()) C(std::forward<Args>(args)...);
+  }
+  void free(C *o) {
+    o->~C();
+    FreeList::free(o);
+  }
+
+  ObjectFreeList(int acount = 64, int aalignment = 16)
+      : FreeList(sizeof(C), acount, aalignment > (int)alignof(C) ? aalignment : (int)alignof(C)) {}
+};
+
 inline void FreeList::init(int asize, int acount, int aalignment) {
   size = asize;
   count = acount;
   alignment = aalignment;
   active = allocated = 0;
+  retain = 1;
   head = 0;
   block_head = 0;
   size = (size + alignment - 1) & ~(alignment - 1);
@@ -94,10 +118,82 @@ inline void FreeList::free(void *ptr) {
 #endif
 }
 
+static inline int freelist_compar_blocks(const void *a, const void *b) {
+  char *i = *(char **)a, *j = *(char **)b;
+  return i < j ? -1 : (i > j ? 1 : 0);
+}
+
+// the block containing p in the sorted blocks, each of bytes
+static inline int freelist_find_block(char **blocks, int n, int bytes, void *p) {
+  int l = 0, h = n - 1;
+  while (l < h) {
+    int m = (l + h + 1) / 2;
+    if (blocks[m] <= (char *)p)
+      l = m;
+    else
+      h = m - 1;
+  }
+  return (char *)p < blocks[l] + bytes ? l : -1;
+}
+
+/*
+  Counts the free objects in each block by walking the free list, then
+  unlinks the objects of all but retain of the blocks which are entirely
+  free and returns those to malloc.  The cost is proportional to the number
+  of free objects, so call it from time to time, not on each free().
+*/
+inline int64_t FreeList::trim() {
+#ifndef VALGRIND_TEST
+  int bytes = size * count, nblocks = 0;
+  for (void *b = block_head; b; b = *(void **)(((char *)b) + bytes)) nblocks++;
+  if (nblocks <= retain || active > (nblocks - retain - 1) * count) return 0;
+  char **blocks = (char **)::malloc(nblocks * (sizeof(char *) + sizeof(int)));
+  int *nfree = (int *)(blocks + nblocks);
+  int n = 0;
+  for (void *b = block_head; b; b = *(void **)(((char *)b) + bytes)) blocks[n++] = (char *)b;
+  qsort(blocks, nblocks, sizeof(char *), freelist_compar_blocks);
+  memset(nfree, 0, nblocks * sizeof(int));
+  for (void *p = head; p; p = *(void **)p) nfree[freelist_find_block(blocks, nblocks, bytes, p)]++;
+  int keep = retain, release = 0;
+  for (int i = 0; i < nblocks; i++)
+    if (nfree[i] == count) {
+      if (keep)
+        keep--;
+      else {
+        nfree[i] = -1;  // released
+        release++;
+      }
+    }
+  if (release) {
+    void **last = &head;
+    for (void *p = head; p; p = *(void **)p)
+      if (nfree[freelist_find_block(blocks, nblocks, bytes, p)] >= 0) {
+        *last = p;
+        last = (void **)p;
+      }
+    *last = 0;
+    last = &block_head;
+    for (int i = 0; i < nblocks; i++)
+      if (nfree[i] < 0)
+        ::free(blocks[i]);
+      else {
+        *last = blocks[i];
+        last = (void **)(blocks[i] + bytes);
+      }
+    *last = 0;
+    allocated -= release * (bytes + sizeof(void *));
+  }
+  ::free(blocks);
+  return (int64_t)release * (bytes + sizeof(void *));
+#else
+  return 0;
+#endif
+}
+
 inline FreeList::~FreeList() {
   while (block_head) {
     void *bh = *(void **)(((char *)block_head) + (count * size));
-    free(block_head);
+    ::free(block_head);
     block_head = bh;
   }
 }
@@ -0,0 +1,132 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#ifndef _futex_H_
+#define _futex_H_
+
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#else
+#include <sys/time.h>
+#endif
+
+/*
+  Minimal futex wrappers and an eventcount built on them.
+
+  futex_wait() sleeps while *addr == val (spurious wakeups are allowed) and
+  returns -1 only on timeout, futex_wake() wakes up to n waiters.  On systems
+  without futexes the calls are emulated with a small table of mutex/condvar
+  pairs hashed by address.
+
+  EventCount lets a consumer park without holding a lock:
+
+    uint32_t key = ec.prepare_wait();
+    if (work_available()) ec.cancel_wait();
+    else ec.wait(key);
+
+  and a producer publishes work then calls ec.notify(n).
+*/
+
+#ifdef __linux__
+
+static inline int futex_wait(volatile uint32_t *addr, uint32_t val, const struct timespec *timeout = 0) {
+  if (syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, val, timeout, 0, 0) < 0 && errno == ETIMEDOUT)
+    return -1;
+  return 0;
+}
+
+static inline int futex_wake(volatile uint32_t *addr, int n = INT_MAX) {
+  return syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, n, 0, 0, 0);
+}
+
+#else
+
+#define FUTEX_EMULATION_TABLE_SIZE 64
+
+struct futex_emulation_t {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+static inline futex_emulation_t *futex_emulation(volatile uint32_t *addr) {
+  static futex_emulation_t table[FUTEX_EMULATION_TABLE_SIZE];
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, [] {
+    for (int i = 0; i < FUTEX_EMULATION_TABLE_SIZE; i++) {
+      pthread_mutex_init(&table[i].mutex, 0);
+      pthread_cond_init(&table[i].cond, 0);
+    }
+  });
+  return &table[(((uintptr_t)addr) >> 2) % FUTEX_EMULATION_TABLE_SIZE];
+}
+
+static inline int futex_wait(volatile uint32_t *addr, uint32_t val, const struct timespec *timeout = 0) {
+  futex_emulation_t *f = futex_emulation(addr);
+  int r = 0;
+  pthread_mutex_lock(&f->mutex);
+  if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) == val) {
+    if (timeout) {
+      struct timeval tv;
+      gettimeofday(&tv, 0);
+      struct timespec abstime;
+      abstime.tv_sec = tv.tv_sec + timeout->tv_sec;
+      abstime.tv_nsec = tv.tv_usec * 1000 + timeout->tv_nsec;
+      if (abstime.tv_nsec >= 1000000000) {
+        abstime.tv_sec++;
+        abstime.tv_nsec -= 1000000000;
+      }
+      r = pthread_cond_timedwait(&f->cond, &f->mutex, &abstime) ? -1 : 0;
+    } else
+      pthread_cond_wait(&f->cond, &f->mutex);
+  }
+  pthread_mutex_unlock(&f->mutex);
+  return r;
+}
+
+static inline int futex_wake(volatile uint32_t *addr, int n = INT_MAX) {
+  futex_emulation_t *f = futex_emulation(addr);
+  pthread_mutex_lock(&f->mutex);
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->mutex);
+  return 0;
+}
+
+#endif
+
+class EventCount {
+ public:
+  volatile uint32_t epoch;
+  volatile int32_t waiters;
+
+  uint32_t prepare_wait() {
+    __atomic_fetch_add(&waiters, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+  }
+  void cancel_wait() { __atomic_fetch_sub(&waiters, 1, __ATOMIC_SEQ_CST); }
+  // returns 0 if woken, -1 on timeout (either may be spurious)
+  int wait(uint32_t key, const struct timespec *timeout = 0) {
+    int r = 0;
+    if (__atomic_load_n(&epoch, __ATOMIC_SEQ_CST) == key) r = futex_wait(&epoch, key, timeout);
+    __atomic_fetch_sub(&waiters, 1, __ATOMIC_SEQ_CST);
+    return r;
+  }
+  void notify(int n = 1) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&waiters, __ATOMIC_SEQ_CST)) return;
+    __atomic_fetch_add(&epoch, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&epoch, n);
+  }
+  void notify_all() { notify(INT_MAX); }
+
+  EventCount() : epoch(0), waiters(0) {}
+};
+
+#endif
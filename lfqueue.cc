@@ -0,0 +1,105 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#include "plib.h"
+
+#ifdef TEST_LIB
+#define TEST_LFQUEUE_N 100000
+#define TEST_LFQUEUE_THREADS 4
+
+class TestLFQueueElem {
+ public:
+  int producer, seq;
+  SLINK(TestLFQueueElem, link);
+};
+
+static SPSCRing<int> *test_spsc;
+static MPMCQueue<intptr_t> *test_mpmc;
+static MPSCQue(TestLFQueueElem, link) test_mpsc;
+static volatile int64 test_lfqueue_sum = 0;
+
+static void *test_spsc_producer(void *) {
+  for (int i = 0; i < TEST_LFQUEUE_N; i++)
+    while (!test_spsc->push(i)) sched_yield();
+  return 0;
+}
+
+static void *test_mpmc_producer(void *data) {
+  intptr_t base = (intptr_t)data * TEST_LFQUEUE_N;
+  for (intptr_t i = 0; i < TEST_LFQUEUE_N; i++)
+    while (!test_mpmc->push(base + i)) sched_yield();
+  return 0;
+}
+
+static void *test_mpmc_consumer(void *) {
+  int64 sum = 0;
+  for (int n = 0; n < TEST_LFQUEUE_N;) {
+    intptr_t x;
+    if (test_mpmc->pop(x)) {
+      sum += x;
+      n++;
+    } else
+      sched_yield();
+  }
+  __atomic_fetch_add(&test_lfqueue_sum, sum, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+static void *test_mpsc_producer(void *data) {
+  TestLFQueueElem *e = (TestLFQueueElem *)data;
+  for (int i = 0; i < TEST_LFQUEUE_N; i++) test_mpsc.enqueue(&e[i]);
+  return 0;
+}
+
+void test_lfqueue() {
+  pthread_t t[2 * TEST_LFQUEUE_THREADS];
+
+  test_spsc = new SPSCRing<int>(100);
+  assert(test_spsc->mask == 127);
+  pthread_create(&t[0], 0, test_spsc_producer, 0);
+  for (int i = 0; i < TEST_LFQUEUE_N;) {
+    int x;
+    if (test_spsc->pop(x))
+      assert(x == i++);
+    else
+      sched_yield();
+  }
+  pthread_join(t[0], 0);
+  assert(!test_spsc->size());
+  delete test_spsc;
+
+  test_mpmc = new MPMCQueue<intptr_t>(64);
+  for (int i = 0; i < 64; i++) assert(test_mpmc->push(i));
+  assert(!test_mpmc->push(64));
+  for (intptr_t i = 0, x; i < 64; i++) assert(test_mpmc->pop(x) && x == i);
+  for (intptr_t i = 0; i < TEST_LFQUEUE_THREADS; i++) {
+    pthread_create(&t[i], 0, test_mpmc_producer, (void *)i);
+    pthread_create(&t[TEST_LFQUEUE_THREADS + i], 0, test_mpmc_consumer, 0);
+  }
+  for (int i = 0; i < 2 * TEST_LFQUEUE_THREADS; i++) pthread_join(t[i], 0);
+  int64 n = (int64)TEST_LFQUEUE_THREADS * TEST_LFQUEUE_N;
+  assert(test_lfqueue_sum == n * (n - 1) / 2);
+  delete test_mpmc;
+
+  TestLFQueueElem *elems = new TestLFQueueElem[TEST_LFQUEUE_THREADS * TEST_LFQUEUE_N];
+  for (int p = 0; p < TEST_LFQUEUE_THREADS; p++)
+    for (int i = 0; i < TEST_LFQUEUE_N; i++) {
+      elems[p * TEST_LFQUEUE_N + i].producer = p;
+      elems[p * TEST_LFQUEUE_N + i].seq = i;
+    }
+  for (intptr_t i = 0; i < TEST_LFQUEUE_THREADS; i++)
+    pthread_create(&t[i], 0, test_mpsc_producer, &elems[i * TEST_LFQUEUE_N]);
+  int next[TEST_LFQUEUE_THREADS] = {0};
+  for (int i = 0; i < TEST_LFQUEUE_THREADS * TEST_LFQUEUE_N;) {
+    if (TestLFQueueElem *e = test_mpsc.dequeue()) {
+      assert(e->seq == next[e->producer]++);
+      i++;
+    } else
+      sched_yield();
+  }
+  for (int i = 0; i < TEST_LFQUEUE_THREADS; i++) pthread_join(t[i], 0);
+  assert(test_mpsc.empty());
+  delete[] elems;
+  printf("lfqueue test\tPASSED\n");
+}
+#endif
@@ -0,0 +1,169 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#ifndef _lfqueue_H_
+#define _lfqueue_H_
+
+/*
+  Lock-free queues for handing off between threads.
+
+    SPSCRing<C>     bounded ring, one producer and one consumer
+    MPMCQueue<C>    bounded queue, any number of producers and consumers
+                    (Vyukov: each cell carries a sequence number)
+    MPSCQueue<C, L> unbounded intrusive queue threaded through an SLINK or
+                    LINK field, e.g. MPSCQue(Job, link), any number of
+                    producers and one consumer
+
+  Bounded queues have a power of 2 capacity; push() returns 0 when full and
+  pop() returns 0 when empty.  Indexes written by different sides live on
+  separate cache lines.
+*/
+
+#define LFQUEUE_CACHE_LINE 64
+
+template <class C>
+class SPSCRing {
+ public:
+  alignas(LFQUEUE_CACHE_LINE) volatile uint64 head;  // written by the consumer
+  uint64 cached_tail;                                // consumer's view of tail
+  alignas(LFQUEUE_CACHE_LINE) volatile uint64 tail;  // written by the producer
+  uint64 cached_head;                                // producer's view of head
+  alignas(LFQUEUE_CACHE_LINE) C *v;
+  uint64 mask;
+
+  int push(C c) {
+    uint64 t = tail;
+    if (t - cached_head > mask) {
+      cached_head = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+      if (t - cached_head > mask) return 0;
+    }
+    v[t & mask] = c;
+    __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+    return 1;
+  }
+  int pop(C &c) {
+    uint64 h = head;
+    if (h == cached_tail) {
+      cached_tail = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+      if (h == cached_tail) return 0;
+    }
+    c = v[h & mask];
+    __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+    return 1;
+  }
+  int64 size() { return __atomic_load_n(&tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&head, __ATOMIC_ACQUIRE); }
+
+  SPSCRing(int capacity) : head(0), cached_tail(0), tail(0), cached_head(0) {
+    uint64 n = 1;
+    while (n < (uint64)capacity) n <<= 1;
+    v = (C *)MALLOC(sizeof(C) * n);
+    mask = n - 1;
+  }
+  ~SPSCRing() { FREE(v); }
+};
+
+template <class C>
+class MPMCQueue {
+ public:
+  struct Cell {
+    volatile uint64 seq;
+    C data;
+  };
+  alignas(LFQUEUE_CACHE_LINE) volatile uint64 enqueue_pos;
+  alignas(LFQUEUE_CACHE_LINE) volatile uint64 dequeue_pos;
+  alignas(LFQUEUE_CACHE_LINE) Cell *cells;
+  uint64 mask;
+
+  int push(C c) {
+    uint64 pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    Cell *cell;
+    while (1) {
+      cell = &cells[pos & mask];
+      int64 dif = (int64)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+      if (!dif) {
+        if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+      } else if (dif < 0)
+        return 0;
+      else
+        pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    }
+    cell->data = c;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+  }
+  int pop(C &c) {
+    uint64 pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+    Cell *cell;
+    while (1) {
+      cell = &cells[pos & mask];
+      int64 dif = (int64)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+      if (!dif) {
+        if (__atomic_compare_exchange_n(&dequeue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+      } else if (dif < 0)
+        return 0;
+      else
+        pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+    }
+    c = cell->data;
+    __atomic_store_n(&cell->seq, pos + mask + 1, __ATOMIC_RELEASE);
+    return 1;
+  }
+  int64 size() {
+    return __atomic_load_n(&enqueue_pos, __ATOMIC_ACQUIRE) - __atomic_load_n(&dequeue_pos, __ATOMIC_ACQUIRE);
+  }
+
+  MPMCQueue(int capacity) : enqueue_pos(0), dequeue_pos(0) {
+    uint64 n = 2;
+    while (n < (uint64)capacity) n <<= 1;
+    cells = (Cell *)MALLOC(sizeof(Cell) * n);
+    for (uint64 i = 0; i < n; i++) cells[i].seq = i;
+    mask = n - 1;
+  }
+  ~MPMCQueue() { FREE(cells); }
+};
+
+/*
+  Producers push onto a lock-free LIFO; when its private FIFO runs dry the
+  consumer takes the whole LIFO with one exchange and reverses it, so each
+  producer's elements come out in the order they went in.
+*/
+template <class C, class L = typename C::Link_link>
+class MPSCQueue {
+ public:
+  alignas(LFQUEUE_CACHE_LINE) C *volatile pushed;  // LIFO, any thread
+  alignas(LFQUEUE_CACHE_LINE) C *head;             // FIFO, consumer only
+
+  C *&next(C *e) { return L::next_link(e); }
+  // returns 1 if the queue may have been empty, e.g. to decide whether to wake the consumer
+  int enqueue(C *e) {
+    C *h = __atomic_load_n(&pushed, __ATOMIC_RELAXED);
+    do
+      next(e) = h;
+    while (!__atomic_compare_exchange_n(&pushed, &h, e, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return !h;
+  }
+  C *dequeue() {
+    if (!head) {
+      C *e = __atomic_exchange_n(&pushed, (C *)0, __ATOMIC_ACQUIRE);
+      while (e) {
+        C *n = next(e);
+        next(e) = head;
+        head = e;
+        e = n;
+      }
+      if (!head) return 0;
+    }
+    C *e = head;
+    head = next(e);
+    next(e) = 0;
+    return e;
+  }
+  bool empty() { return !head && !__atomic_load_n(&pushed, __ATOMIC_ACQUIRE); }
+
+  MPSCQueue() : pushed(0), head(0) {}
+};
+#define MPSCQue(_c, _f) MPSCQueue<_c, _c::Link##_##_f>
+
+void test_lfqueue();
+
+#endif
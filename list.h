@@ -265,7 +265,7 @@ inline void Queue<C, L>::insert(C *e, C *after) {
 
 template <class C, class L>
 inline void Queue<C, L>::remove(C *e) {
-  if (tail == e) tail = prev(e);
+  if (tail == e) tail = this->prev(e);
   DLL<C, L>::remove(e);
 }
 
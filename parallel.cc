@@ -0,0 +1,168 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#include "plib.h"
+
+// each participant owns a [begin, end) range packed into one word so that the
+// owner can take chunks from the front and thieves split off the back with a CAS
+struct ParallelSlot {
+  volatile uint64 range;
+  char pad[THREAD_POOL_CACHE_LINE - sizeof(uint64)];
+};
+
+struct ParallelState {
+  ParallelSlot slot[PARALLEL_MAX_SLOTS];
+  int nslots;
+  int grain;
+  parallel_body_fn body;
+  void *ctx;
+  volatile int next_slot;  // claimed by helpers as they start
+  volatile int remaining;  // iterations not yet completed
+  volatile uint32_t done;  // futex for the caller
+  volatile int refs;       // caller and helpers
+};
+
+static inline uint64 range_pack(int b, int e) { return (((uint64)(uint32)b) << 32) | (uint32)e; }
+static inline int range_begin(uint64 r) { return (int)(r >> 32); }
+static inline int range_end(uint64 r) { return (int)(uint32)r; }
+
+static int ncpus() {
+  static int n = 0;
+  if (!n) {
+    long c = sysconf(_SC_NPROCESSORS_ONLN);
+    n = c > 0 ? (int)c : 1;
+  }
+  return n;
+}
+
+int parallel_slots(ThreadPool &pool, int n, int grain, int nslots) {
+  if (n <= 0) return 0;
+  if (grain < 1) grain = 1;
+  if (nslots <= 0) {
+    nslots = ncpus();
+    if (pool.maxthreads < nslots - 1) nslots = pool.maxthreads + 1;
+  }
+  int chunks = n / grain + (n % grain ? 1 : 0);
+  if (nslots > chunks) nslots = chunks;
+  if (nslots > PARALLEL_MAX_SLOTS) nslots = PARALLEL_MAX_SLOTS;
+  return nslots;
+}
+
+static void parallel_release(ParallelState *s) {
+  if (!__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL)) FREE(s);
+}
+
+// move the upper half of the largest range to slot me, return 0 if there is no work left
+static int parallel_steal(ParallelState *s, int me) {
+  while (1) {
+    int victim = -1, most = 0;
+    uint64 vr = 0;
+    for (int i = 0; i < s->nslots; i++) {
+      if (i == me) continue;
+      uint64 r = __atomic_load_n(&s->slot[i].range, __ATOMIC_ACQUIRE);
+      int size = range_end(r) - range_begin(r);
+      if (size > most) {
+        most = size;
+        victim = i;
+        vr = r;
+      }
+    }
+    if (victim < 0) return 0;
+    int b = range_begin(vr), e = range_end(vr);
+    int mid = most > s->grain ? e - most / 2 : b;
+    if (__atomic_compare_exchange_n(&s->slot[victim].range, &vr, range_pack(b, mid), false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_RELAXED)) {
+      __atomic_store_n(&s->slot[me].range, range_pack(mid, e), __ATOMIC_RELEASE);
+      return 1;
+    }
+  }
+}
+
+static void parallel_participate(ParallelState *s, int me) {
+  while (1) {
+    uint64 r = __atomic_load_n(&s->slot[me].range, __ATOMIC_ACQUIRE);
+    int b = range_begin(r), e = range_end(r);
+    if (b < e) {
+      int ne = e - b > s->grain ? b + s->grain : e;
+      if (!__atomic_compare_exchange_n(&s->slot[me].range, &r, range_pack(ne, e), false, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_RELAXED))
+        continue;
+      s->body(s->ctx, me, b, ne);
+      if (!__atomic_sub_fetch(&s->remaining, ne - b, __ATOMIC_ACQ_REL)) {
+        __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+        futex_wake(&s->done);
+      }
+      continue;
+    }
+    if (!parallel_steal(s, me)) return;
+  }
+}
+
+static void *parallel_helper(void *data) {
+  ParallelState *s = (ParallelState *)data;
+  int me = __atomic_fetch_add(&s->next_slot, 1, __ATOMIC_ACQ_REL);
+  parallel_participate(s, me);
+  parallel_release(s);
+  return 0;
+}
+
+void parallel_run(ThreadPool &pool, int n, int grain, parallel_body_fn body, void *ctx, int nslots) {
+  if (grain < 1) grain = 1;
+  nslots = parallel_slots(pool, n, grain, nslots);
+  if (!nslots) return;
+  if (nslots == 1) {
+    body(ctx, 0, 0, n);
+    return;
+  }
+  ParallelState *s = (ParallelState *)MALLOC(sizeof(ParallelState));
+  memset((void *)s, 0, sizeof(ParallelState));
+  s->nslots = nslots;
+  s->grain = grain;
+  s->body = body;
+  s->ctx = ctx;
+  s->next_slot = 1;
+  s->remaining = n;
+  s->refs = nslots;
+  s->slot[0].range = range_pack(0, n);
+  void *data[PARALLEL_MAX_SLOTS];
+  for (int i = 0; i < nslots - 1; i++) data[i] = s;
+  pool.add_jobs(parallel_helper, data, nslots - 1);
+  parallel_participate(s, 0);
+  while (!__atomic_load_n(&s->done, __ATOMIC_ACQUIRE)) futex_wait(&s->done, 0);
+  parallel_release(s);
+}
+
+#ifdef TEST_LIB
+void test_parallel() {
+  for (int ws = 0; ws < 2; ws++) {
+    ThreadPool pool(0, 4, ws);
+    Vec<int> v;
+    for (int i = 0; i < 10000; i++) v.add(i);
+    parallel_forv(pool, v, [](int &x) { x *= 2; }, 16);
+    for (int i = 0; i < 10000; i++) assert(v[i] == i * 2);
+    volatile int hits[1000];
+    for (int i = 0; i < 1000; i++) hits[i] = 0;
+    parallel_for(pool, xrange(0, 1000, 3), [&](int i) { __atomic_fetch_add(&hits[i], 1, __ATOMIC_RELAXED); });
+    for (int i = 0; i < 1000; i++) assert(hits[i] == (i % 3 ? 0 : 1));
+    int64 sum = parallel_reduce(
+        pool, xrange(v.n), (int64)0, [&](int64 acc, int i) { return acc + v[i]; },
+        [](int64 x, int64 y) { return x + y; }, 7);
+    assert(sum == (int64)9999 * 10000);
+    struct Ctx {
+      volatile int hits[5000];
+      volatile int slots;
+    } ctx;
+    memset((void *)&ctx, 0, sizeof(ctx));
+    parallel_run(
+        pool, 5000, 3,
+        [](void *c, int slot, int b, int e) {
+          Ctx *x = (Ctx *)c;
+          __atomic_fetch_or(&x->slots, 1 << slot, __ATOMIC_RELAXED);
+          for (int i = b; i < e; i++) __atomic_fetch_add(&x->hits[i], 1, __ATOMIC_RELAXED);
+        },
+        &ctx, 4);
+    for (int i = 0; i < 5000; i++) assert(ctx.hits[i] == 1);
+  }
+  printf("parallel test\tPASSED\n");
+}
+#endif
@@ -0,0 +1,89 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#ifndef _parallel_H_
+#define _parallel_H_
+
+/*
+  Data parallel loops on a ThreadPool.
+
+    parallel_for(pool, xrange(v.n), [&](int i) { v[i] = f(v[i]); });
+    int64 sum = parallel_reduce(pool, xrange(n), (int64)0,
+                                [&](int64 acc, int i) { return acc + a[i]; },
+                                [](int64 x, int64 y) { return x + y; });
+
+  The range is handed out in chunks of at least grain iterations.  The calling
+  thread participates and helpers are added to the pool; idle participants
+  steal the upper half of the largest remaining range, so the range is split
+  by recursive halving only as far as needed.  The call returns once every
+  iteration has completed.  Calls may be nested inside pool jobs.
+*/
+
+#define PARALLEL_MAX_SLOTS 64
+
+// body is called with indexes into [0, n) and the participant slot in [0, nslots)
+typedef void (*parallel_body_fn)(void *ctx, int slot, int begin, int end);
+
+int parallel_slots(ThreadPool &pool, int n, int grain, int nslots = 0);
+void parallel_run(ThreadPool &pool, int n, int grain, parallel_body_fn body, void *ctx, int nslots = 0);
+
+template <class F>
+void parallel_for(ThreadPool &pool, const xrange &r, F fn, int grain = 1) {
+  struct Ctx {
+    F *fn;
+    int first, increment;
+  } ctx = {&fn, r.first(), r.increment()};
+  parallel_run(
+      pool, r.size(), grain,
+      [](void *c, int slot, int b, int e) {
+        Ctx *x = (Ctx *)c;
+        for (int i = b; i < e; i++) (*x->fn)(x->first + i * x->increment);
+      },
+      &ctx);
+}
+
+template <class C, class A, int S, class F>
+void parallel_forv(ThreadPool &pool, Vec<C, A, S> &v, F fn, int grain = 1) {
+  struct Ctx {
+    F *fn;
+    C *v;
+  } ctx = {&fn, v.v};
+  parallel_run(
+      pool, v.n, grain,
+      [](void *c, int slot, int b, int e) {
+        Ctx *x = (Ctx *)c;
+        for (int i = b; i < e; i++) (*x->fn)(x->v[i]);
+      },
+      &ctx);
+}
+
+// fn(T acc, int i) -> T folds an iteration into a participant's partial result,
+// combine(T, T) -> T merges the partial results in slot order
+template <class T, class F, class R>
+T parallel_reduce(ThreadPool &pool, const xrange &r, T identity, F fn, R combine, int grain = 1) {
+  int n = r.size();
+  int nslots = parallel_slots(pool, n, grain);
+  T partial[PARALLEL_MAX_SLOTS];
+  for (int i = 0; i < nslots; i++) partial[i] = identity;
+  struct Ctx {
+    F *fn;
+    T *partial;
+    int first, increment;
+  } ctx = {&fn, partial, r.first(), r.increment()};
+  parallel_run(
+      pool, n, grain,
+      [](void *c, int slot, int b, int e) {
+        Ctx *x = (Ctx *)c;
+        T acc = x->partial[slot];
+        for (int i = b; i < e; i++) acc = (*x->fn)(acc, x->first + i * x->increment);
+        x->partial[slot] = acc;
+      },
+      &ctx, nslots);
+  T result = identity;
+  for (int i = 0; i < nslots; i++) result = combine(result, partial[i]);
+  return result;
+}
+
+void test_parallel();
+
+#endif
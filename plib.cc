@@ -8,7 +8,16 @@ int main(int argc, char *argv[]) {
   INIT_RAND64(time(NULL));
   test_stat();
   test_list();
+  test_lfqueue();
+  test_cfreelist();
   test_vec();
   test_map();
+  test_arena();
+  test_tmalloc();
+  test_threadpool();
+  test_parallel();
+  test_barrier();
+  test_conn();
+  test_connpool();
   exit(0);
 }
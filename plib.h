@@ -10,6 +10,7 @@
 #include "gc.h"
 #define MEM_INIT() GC_INIT()
 #define MALLOC(_n) GC_MALLOC(_n)
+#define MALLOC_ATOMIC(_n) GC_MALLOC_ATOMIC(_n)  // never holds pointers, e.g. I/O buffers
 #define REALLOC(_p, _n) GC_REALLOC((_p), (_n))
 #define MEMALIGN(_p, _n, _a) _p = GC_MALLOC(_n)
 #define CHECK_LEAKS() GC_gcollect()
@@ -20,16 +21,27 @@
 #include "gc_cpp.h"
 #define MEM_INIT() GC_INIT()
 #define MALLOC(_n) GC_MALLOC(_n)
+#define MALLOC_ATOMIC(_n) GC_MALLOC_ATOMIC(_n)
 #define REALLOC(_p, _n) GC_REALLOC((_p), (_n))
 #define MEMALIGN(_p, _n, _a) _p = GC_MALLOC(_n)
 #define FREE(_x) (void)(_x)
 #define DELETE(_x) (void)(_x)
 #else
 #define MEM_INIT()
+#ifdef USE_TMALLOC  // per thread dlmalloc mspaces
+#include "tmalloc.h"
+#define MALLOC tmalloc
+#define MALLOC_ATOMIC tmalloc
+#define REALLOC trealloc
+#define MEMALIGN(_p, _a, _n) (((_p) = (decltype(_p))tmemalign((_a), (_n))) ? 0 : ENOMEM)
+#define FREE tfree
+#else
 #define MALLOC ::malloc
+#define MALLOC_ATOMIC ::malloc
 #define REALLOC ::realloc
 #define MEMALIGN(_p, _a, _n) ::posix_memalign((void **)&(_p), (_a), (_n))
 #define FREE ::free
+#endif
 #define DELETE(_x) delete _x
 class gc {};
 #endif
@@ -116,20 +128,28 @@ typedef const char *ccharptr_t;
 
 #include "tls.h"
 #include "arg.h"
+#include "futex.h"
 #include "barrier.h"
 #include "config.h"
 #include "stat.h"
 #include "dlmalloc.h"
+#include "tmalloc.h"
 #include "freelist.h"
 #include "defalloc.h"
+#include "arena.h"
 #include "list.h"
+#include "lfqueue.h"
+#include "cfreelist.h"
 #include "log.h"
 #include "vec.h"
 #include "map.h"
 #include "threadpool.h"
 #include "misc.h"
 #include "util.h"
+#include "parallel.h"
+#include "uring.h"
 #include "conn.h"
+#include "connpool.h"
 #include "md5.h"
 #include "mt64.h"
 #include "hash.h"
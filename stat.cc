@@ -118,6 +118,20 @@ void register_global_stat(cchar *name, Stat &s) {
   pthread_mutex_unlock(&stat_mutex);
 }
 
+void unregister_global_stat(Stat &s, Stat *into) {
+  pthread_mutex_lock(&stat_mutex);
+  for (Stat **p = &global_stats; *p; p = &(*p)->next)
+    if (*p == &s) {
+      *p = s.next;
+      break;
+    }
+  if (into) {
+    __sync_fetch_and_add(&into->sum, s.sum);
+    __sync_fetch_and_add(&into->count, s.count);
+  }
+  pthread_mutex_unlock(&stat_mutex);
+}
+
 void register_stat(cchar *name, Stat &s) {
   pthread_mutex_lock(&stat_mutex);
   get_stat_id(name, s);
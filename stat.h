@@ -16,6 +16,7 @@ void init_stat();
 void init_stat_thread();
 void register_stat(cchar *name, Stat &s);         // per thread
 void register_global_stat(cchar *name, Stat &s);  // per process
+void unregister_global_stat(Stat &s, Stat *into = 0);  // optionally folding its values into another
 int process_stat_snap_internal();
 EXTERN Stat *stat_snap_requested EXTERN_INIT(0);
 static inline int process_stat_snap() {  // call in event loop
@@ -3,66 +3,377 @@
 */
 #include "plib.h"
 
-static void *thread_pool_start(void *data) {
-  ThreadPool *pool = (ThreadPool *)data;
+DEF_TLS(ThreadPoolWorker *, thread_pool_worker);
+DEF_TLS(ThreadPoolStats *, thread_pool_stats);
+
+static void *thread_pool_ws_start(ThreadPool *pool, int cpu, int node) {
+  ThreadPoolWorker *w = pool->ws_attach();  // after placement so worker memory is local
+  w->cpu = cpu;
+  w->node = node;
+  INIT_TLS(thread_pool_worker);
+  TLS(thread_pool_worker) = w;
+  while (ThreadPoolJob *job = pool->ws_get_job(w)) {
+    uint64 started = job->queued ? pool->stat_started(job->queued) : 0;
+    if (job->thread_pool_integral)
+      job->main();
+    else {
+      void *(*start)(void *) = job->start;
+      void *data = job->data;
+      pool->ws_job_freelist->free(job);
+      start(data);
+    }
+    if (started) pool->stat_finished(started);
+  }
+  TLS(thread_pool_worker) = 0;
+  return 0;
+}
+
+static void thread_pool_run(ThreadPool *pool) {
   while (1) {
     void *(*start)(void *);
     void *data;
     ThreadPoolJob *job = 0;
-    if (pool->get_job(&start, &data, &job)) return 0;
+    uint64 queued = 0;
+    if (pool->get_job(&start, &data, &job, &queued)) return;
+    uint64 started = queued ? pool->stat_started(queued) : 0;
     if (job)
       job->main();
     else
       start(data);
+    if (started) pool->stat_finished(started);
   }
 }
 
-pthread_t ThreadPool::thread_create(void *(*start_routine)(void *), void *arg, int stacksize) {
+static void *thread_pool_start(void *data) {
+  ThreadPool *pool = (ThreadPool *)data;
+  int cpu, node;
+  pool->place_thread(&cpu, &node);
+  INIT_TLS(thread_pool_stats);
+  if (pool->stats) {  // folded into the shared stats by exit_thread_stats()
+    ThreadPoolStats *stats = new ThreadPoolStats(pool, 0);
+    stats->register_stats(pool->stats_name);
+    TLS(thread_pool_stats) = stats;
+  }
+  if (pool->stealing())
+    thread_pool_ws_start(pool, cpu, node);
+  else
+    thread_pool_run(pool);
+  return 0;
+}
+
+pthread_t ThreadPool::thread_create(void *(*start_routine)(void *), void *arg, int stacksize, int detached) {
   pthread_t t;
   pthread_attr_t attr;
   pthread_attr_init(&attr);
   if (stacksize) pthread_attr_setstacksize(&attr, stacksize);
+  if (detached) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
   pthread_create(&t, &attr, start_routine, arg);
   pthread_attr_destroy(&attr);
   return t;
 }
 
 static void start_thread(ThreadPool *pool) {
+  pool->init_placement();
   pool->nthreads++;
-  ThreadPool::thread_create(thread_pool_start, (void *)pool, pool->stacksize);
+  if (pool->stats) pool->stats->add(THREAD_POOL_STAT_SPAWNS, 1);
+  ThreadPool::thread_create(thread_pool_start, (void *)pool, pool->stacksize, 1);  // never joined, may retire
+}
+
+/*
+  Elastic sizing
+
+  Up to minthreads threads are started as soon as there is work.  Beyond
+  that, when spawn_delay is set, jobs which find no waiting thread are left
+  queued and a monitor thread starts one thread per spawn_delay for as long
+  as they remain queued, so short bursts are absorbed by the running threads.
+  Threads above minthreads which are idle for idle_timeout exit.
+*/
+
+static void *thread_pool_monitor(void *data) {
+  ThreadPool *pool = (ThreadPool *)data;
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->maxthreads) {
+    hrtime_t delay = pool->spawn_delay * HRTIME_USEC;
+    pthread_mutex_unlock(&pool->mutex);
+    wait_for(delay);
+    pthread_mutex_lock(&pool->mutex);
+    if (!pool->backlog()) break;
+    if (!__atomic_load_n(&pool->nthreadswaiting, __ATOMIC_SEQ_CST) && pool->nthreads < pool->thread_limit())
+      start_thread(pool);
+  }
+  pool->monitoring = 0;
+  pthread_cond_broadcast(&pool->shutdown_condition);
+  pthread_mutex_unlock(&pool->mutex);
+  return 0;
 }
 
-void ThreadPool::add_job(void *(*start)(void *), void *data) {
+// whether to start a thread now, otherwise ensure the monitor is running, called with the mutex held
+int ThreadPool::may_spawn() {
+  if (nthreads >= thread_limit()) return 0;
+  if (nthreads < minthreads || !nthreads || spawn_delay <= 0) return 1;
+  if (!monitoring) {
+    monitoring = 1;
+    thread_create(thread_pool_monitor, (void *)this, 0, 1);
+  }
+  return 0;
+}
+
+// jobs are waiting for a thread, called with the mutex held
+int ThreadPool::backlog() { return stealing() ? ws_has_work() : jobs.size; }
+
+/*
+  Statistics
+*/
+
+static cchar *thread_pool_stat_names[] = {"queue_depth", "queue_wait_us", "run_time_us",
+                                          "spawns",      "retirements",   "steals"};
+
+ThreadPoolStats::ThreadPoolStats(ThreadPool *apool, int ashared) : pool(apool), shared(ashared) {
+  memset((void *)stat, 0, sizeof(stat));
+}
+
+void ThreadPoolStats::add_time(int i, int hist, uint64 usec) {
+  int b = usec ? 64 - __builtin_clzll(usec) : 0;
+  if (b >= THREAD_POOL_HISTOGRAM_BUCKETS) b = THREAD_POOL_HISTOGRAM_BUCKETS - 1;
+  add(i, 1, usec);
+  add(hist + b, 1);
+}
+
+void ThreadPoolStats::register_stats(cchar *prefix) {
+  char name[256];
+  for (int i = 0; i < THREAD_POOL_STATS; i++) {
+    if (i < THREAD_POOL_STAT_QUEUE_WAIT_HIST)
+      snprintf(name, sizeof(name), "%s.%s", prefix, thread_pool_stat_names[i]);
+    else {
+      int hist = i < THREAD_POOL_STAT_RUN_TIME_HIST ? THREAD_POOL_STAT_QUEUE_WAIT_HIST : THREAD_POOL_STAT_RUN_TIME_HIST;
+      int b = i - hist;
+      cchar *what = hist == THREAD_POOL_STAT_QUEUE_WAIT_HIST ? "queue_wait" : "run_time";
+      if (b < THREAD_POOL_HISTOGRAM_BUCKETS - 1)
+        snprintf(name, sizeof(name), "%s.%s_lt_%lluus", prefix, what, 1ULL << b);
+      else
+        snprintf(name, sizeof(name), "%s.%s_ge_%lluus", prefix, what, 1ULL << (b - 1));
+    }
+    register_global_stat(name, stat[i]);
+  }
+}
+
+void ThreadPoolStats::unregister_stats(ThreadPoolStats *into) {
+  for (int i = 0; i < THREAD_POOL_STATS; i++) unregister_global_stat(stat[i], into ? &into->stat[i] : 0);
+}
+
+void ThreadPool::init_stats() {
   pthread_mutex_lock(&mutex);
-  ThreadPoolJob *job = job_freelist.alloc();
+  if (!stats) {
+    ThreadPoolStats *s = new ThreadPoolStats(this, 1);
+    s->register_stats(stats_name);
+    __atomic_store_n(&stats, s, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+// fold an exiting thread's stats into the shared stats, called with the mutex held before nthreads drops
+void ThreadPool::exit_thread_stats() {
+  ThreadPoolStats *s = TLS(thread_pool_stats);
+  if (!s || s->pool != this) return;
+  TLS(thread_pool_stats) = 0;
+  s->unregister_stats(stats);
+  delete s;
+}
+
+// the calling thread's stats if it belongs to this pool, otherwise the shared stats
+ThreadPoolStats *ThreadPool::thread_stats() {
+  ThreadPoolStats *s = TLS(thread_pool_stats);
+  return (s && s->pool == this) ? s : stats;
+}
+
+// count n jobs as queued, returns the time to stamp them with or 0 if not keeping stats
+uint64 ThreadPool::stat_enqueued(int n) {
+  if (!stats) return 0;
+  thread_stats()->add(THREAD_POOL_STAT_QUEUE_DEPTH, n);
+  return hrtime();
+}
+
+uint64 ThreadPool::stat_started(uint64 queued) {
+  ThreadPoolStats *s = thread_stats();
+  uint64 now = hrtime();
+  s->add(THREAD_POOL_STAT_QUEUE_DEPTH, -1);
+  s->add_time(THREAD_POOL_STAT_QUEUE_WAIT, THREAD_POOL_STAT_QUEUE_WAIT_HIST,
+              now > queued ? (now - queued) / HRTIME_USEC : 0);
+  return now;
+}
+
+void ThreadPool::stat_finished(uint64 started) {
+  uint64 now = hrtime();
+  thread_stats()->add_time(THREAD_POOL_STAT_RUN_TIME, THREAD_POOL_STAT_RUN_TIME_HIST,
+                           now > started ? (now - started) / HRTIME_USEC : 0);
+}
+
+/*
+  Priorities
+
+  Lanes are served in strict priority order so that background work never
+  delays interactive work.  Within a lane jobs with a deadline are run
+  earliest deadline first from a binary heap, ahead of the FIFO.
+*/
+
+static inline bool deadline_before(ThreadPoolJob *a, ThreadPoolJob *b) { return a->deadline < b->deadline; }
+
+static void heap_push(Vec<ThreadPoolJob *> &h, ThreadPoolJob *job) {
+  h.add(job);
+  int i = h.n - 1;
+  while (i) {
+    int p = (i - 1) / 2;
+    if (!deadline_before(h.v[i], h.v[p])) break;
+    ThreadPoolJob *t = h.v[i];
+    h.v[i] = h.v[p];
+    h.v[p] = t;
+    i = p;
+  }
+}
+
+static ThreadPoolJob *heap_pop(Vec<ThreadPoolJob *> &h) {
+  ThreadPoolJob *top = h.v[0], *last = h.pop();
+  if (!h.n) return top;
+  h.v[0] = last;
+  int i = 0;
+  while (1) {
+    int c = 2 * i + 1;
+    if (c >= h.n) break;
+    if (c + 1 < h.n && deadline_before(h.v[c + 1], h.v[c])) c++;
+    if (!deadline_before(h.v[c], h.v[i])) break;
+    ThreadPoolJob *t = h.v[i];
+    h.v[i] = h.v[c];
+    h.v[c] = t;
+    i = c;
+  }
+  return top;
+}
+
+static inline int job_lane(ThreadPoolJob *job) {
+  int p = job->priority;
+  return p < 0 ? 0 : (p >= THREAD_POOL_PRIORITIES ? THREAD_POOL_PRIORITIES - 1 : p);
+}
+
+void ThreadPoolQueue::enqueue(ThreadPoolJob *job) {
+  if (job->deadline)
+    heap_push(deadlines[job_lane(job)], job);
+  else
+    fifo[job_lane(job)].enqueue(job);
+  size++;
+}
+
+ThreadPoolJob *ThreadPoolQueue::dequeue(int lowest) {
+  for (int i = 0; i <= lowest && i < THREAD_POOL_PRIORITIES; i++) {
+    ThreadPoolJob *job = deadlines[i].n ? heap_pop(deadlines[i]) : fifo[i].dequeue();
+    if (job) {
+      size--;
+      return job;
+    }
+  }
+  return 0;
+}
+
+static inline void set_job(ThreadPoolJob *job, void *(*start)(void *), void *data, int priority, uint64 deadline,
+                           uint64 queued) {
   job->start = start;
   job->data = data;
+  job->priority = priority;
+  job->deadline = deadline;
+  job->queued = queued;
+}
+
+void ThreadPool::add_job(void *(*start)(void *), void *data, int priority, uint64 deadline) {
+  check_stats();
+  if (work_stealing) {
+    ws_enqueue(0, 1, start, &data, priority, deadline);
+    return;
+  }
+  pthread_mutex_lock(&mutex);
+  ThreadPoolJob *job = job_freelist.alloc();
+  set_job(job, start, data, priority, deadline, stat_enqueued(1));
   jobs.enqueue(job);
-  if (nthreadswaiting) {
+  if (nthreadswaiting >= jobs.size)  // waiters not already taken by earlier jobs
     pthread_cond_signal(&condition);
-    pthread_mutex_unlock(&mutex);
-  } else if (nthreads < maxthreads) {
-    pthread_mutex_unlock(&mutex);
+  else if (may_spawn())
     start_thread(this);
-  }
+  pthread_mutex_unlock(&mutex);
 }
 
 void ThreadPool::add_job(ThreadPoolJob *ajob) {
-  pthread_mutex_lock(&mutex);
   ajob->thread_pool_integral = 1;
+  check_stats();
+  if (work_stealing) {
+    ws_enqueue(&ajob, 1);
+    return;
+  }
+  pthread_mutex_lock(&mutex);
+  ajob->queued = stat_enqueued(1);
   jobs.enqueue(ajob);
-  if (nthreadswaiting)
+  if (nthreadswaiting >= jobs.size)  // waiters not already taken by earlier jobs
     pthread_cond_signal(&condition);
-  else if (nthreads < maxthreads)
+  else if (may_spawn())
     start_thread(this);
   pthread_mutex_unlock(&mutex);
 }
 
-int ThreadPool::get_job(void *(**start)(void *), void **data, ThreadPoolJob **ajob) {
+/*
+  Wake threads for the n jobs just queued and start threads for the rest,
+  called with the mutex held.  Signalled waiters only decrement
+  nthreadswaiting once they run, so waiters are only counted as free beyond
+  the jobs queued before these.
+*/
+void ThreadPool::wake(int n) {
+  int spare = nthreadswaiting - (jobs.size - n);
+  int w = spare <= 0 ? 0 : n < spare ? n : spare;
+  if (w == nthreadswaiting && w > 1)
+    pthread_cond_broadcast(&condition);
+  else
+    for (int i = 0; i < w; i++) pthread_cond_signal(&condition);
+  for (int i = w; i < n && may_spawn(); i++) start_thread(this);
+}
+
+void ThreadPool::add_jobs(void *(*start)(void *), void **data, int n, int priority, uint64 deadline) {
+  if (n <= 0) return;
+  check_stats();
+  if (work_stealing) {
+    ws_enqueue(0, n, start, data, priority, deadline);
+    return;
+  }
+  pthread_mutex_lock(&mutex);
+  uint64 queued = stat_enqueued(n);
+  for (int i = 0; i < n; i++) {
+    ThreadPoolJob *job = job_freelist.alloc();
+    set_job(job, start, data[i], priority, deadline, queued);
+    jobs.enqueue(job);
+  }
+  wake(n);
+  pthread_mutex_unlock(&mutex);
+}
+
+void ThreadPool::add_jobs(ThreadPoolJob **ajobs, int n) {
+  if (n <= 0) return;
+  for (int i = 0; i < n; i++) ajobs[i]->thread_pool_integral = 1;
+  check_stats();
+  if (work_stealing) {
+    ws_enqueue(ajobs, n);
+    return;
+  }
+  pthread_mutex_lock(&mutex);
+  uint64 queued = stat_enqueued(n);
+  for (int i = 0; i < n; i++) {
+    ajobs[i]->queued = queued;
+    jobs.enqueue(ajobs[i]);
+  }
+  wake(n);
+  pthread_mutex_unlock(&mutex);
+}
+
+int ThreadPool::get_job(void *(**start)(void *), void **data, ThreadPoolJob **ajob, uint64 *queued) {
   pthread_mutex_lock(&mutex);
   while (1) {
     ThreadPoolJob *job = jobs.dequeue();
     if (job) {
+      *queued = job->queued;
       if (job->thread_pool_integral)
         *ajob = job;
       else {
@@ -75,10 +386,22 @@ int ThreadPool::get_job(void *(**start)(void *), void **data, ThreadPoolJob **aj
     }
     if (nthreadswaiting + 1 > maxthreads) break;
     nthreadswaiting++;
-    pthread_cond_wait(&condition, &mutex);
-    nthreadswaiting--;
+    if (idle_timeout > 0 && nthreads > minthreads) {
+      struct timespec ts;
+      hrtime_to_ts(hrtime() + idle_timeout * HRTIME_MSEC, &ts);
+      int r = pthread_cond_timedwait(&condition, &mutex, &ts);
+      nthreadswaiting--;
+      if (r == ETIMEDOUT && !jobs.size && nthreads > minthreads) {
+        if (stats) thread_stats()->add(THREAD_POOL_STAT_RETIREMENTS, 1);
+        break;
+      }
+    } else {
+      pthread_cond_wait(&condition, &mutex);
+      nthreadswaiting--;
+    }
     if (nthreadswaiting + 1 > maxthreads) break;
   }
+  exit_thread_stats();
   nthreads--;
   if (nthreadswaiting)
     pthread_cond_signal(&condition);
@@ -88,13 +411,515 @@ int ThreadPool::get_job(void *(**start)(void *), void **data, ThreadPoolJob **aj
   return 1;
 }
 
-ThreadPool::ThreadPool(int astacksize, int amaxthreads) {
+/*
+  Placement
+
+  Workers are pinned round robin to the cpus in the cpulist, interleaved
+  across NUMA nodes when numa is set.  Placement happens on the new thread
+  before any of its per-worker memory is allocated so that first touch puts
+  that memory on the local node.  The topology comes from sysfs.
+*/
+
+static Vec<int> cpu_node_map;
+static int nnuma_nodes = 1;
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+// parse a cpulist, e.g. "0-3,8,10-11"
+void parse_cpulist(cchar *s, Vec<int> &cpus) {
+  while (*s) {
+    while (*s && !isdigit(*s)) s++;
+    if (!*s) break;
+    int a = strtol(s, (char **)&s, 10), b = a;
+    if (*s == '-') b = strtol(s + 1, (char **)&s, 10);
+    for (int i = a; i <= b; i++) cpus.add(i);
+  }
+}
+
+static void init_topology() {
+#ifdef __linux__
+  for (int node = 0; node < THREAD_POOL_MAX_NODES; node++) {
+    char fn[128], buf[4096];
+    snprintf(fn, sizeof(fn), "/sys/devices/system/node/node%d/cpulist", node);
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0) continue;
+    int n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) continue;
+    buf[n] = 0;
+    Vec<int> cpus;
+    parse_cpulist(buf, cpus);
+    for (int i = 0; i < cpus.n; i++) {
+      while (cpu_node_map.n <= cpus[i]) cpu_node_map.add(0);
+      cpu_node_map[cpus[i]] = node;
+    }
+    if (node + 1 > nnuma_nodes) nnuma_nodes = node + 1;
+  }
+#endif
+}
+
+int numa_node_count() {
+  pthread_once(&topology_once, init_topology);
+  return nnuma_nodes;
+}
+
+int numa_node_of_cpu(int cpu) {
+  pthread_once(&topology_once, init_topology);
+  return (cpu >= 0 && cpu < cpu_node_map.n) ? cpu_node_map[cpu] : 0;
+}
+
+static int current_cpu() {
+#ifdef __linux__
+  return sched_getcpu();
+#else
+  return -1;
+#endif
+}
+
+// called with the mutex held before a thread is started
+void ThreadPool::init_placement() {
+  if (cpus && !cpu_list.n) {
+    Vec<int> l;
+    parse_cpulist(cpus, l);
+    if (numa) {  // interleave nodes so that a small pool is spread across them
+      while (cpu_list.n < l.n)
+        for (int node = 0; node < numa_node_count(); node++)
+          for (int i = 0; i < l.n; i++)
+            if (l[i] >= 0 && numa_node_of_cpu(l[i]) == node) {
+              cpu_list.add(l[i]);
+              l[i] = -1;
+              break;
+            }
+    } else
+      cpu_list.copy(l);
+  }
+}
+
+// pin the calling thread, returning its cpu (-1 if not pinned) and node
+void ThreadPool::place_thread(int *cpu, int *node) {
+  *cpu = -1;
+  if (cpu_list.n) {
+    int k = __atomic_fetch_add(&nplaced, 1, __ATOMIC_RELAXED);
+    *cpu = cpu_list[k % cpu_list.n];
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(*cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+  }
+  *node = numa ? numa_node_of_cpu(*cpu >= 0 ? *cpu : current_cpu()) : 0;
+  if (nnodes && *node >= nnodes) *node %= nnodes;
+}
+
+ThreadPoolNode *ThreadPool::local_node() {
+  if (nnodes == 1) return nodes;
+  return &nodes[numa_node_of_cpu(current_cpu()) % nnodes];
+}
+
+/*
+  Work stealing mode
+
+  Each worker owns a WorkDeque.  Normal priority jobs without a deadline added
+  from a worker of this pool go onto its own deque without locking, all other
+  jobs go onto the shared queue of the local node under its mutex.  An idle
+  worker takes interactive jobs from the shared queues, then from its own
+  deque, then normal jobs from the shared queues (moving a batch to its deque),
+  then steals from the other workers, then takes background jobs, and finally
+  parks on the idle EventCount.
+*/
+
+static WorkDeque::Array *new_deque_array(int64 n) {
+  WorkDeque::Array *a = (WorkDeque::Array *)MALLOC(sizeof(WorkDeque::Array) + sizeof(ThreadPoolJob *) * (n - 1));
+  a->mask = n - 1;
+  return a;
+}
+
+WorkDeque::WorkDeque() : top(0), bottom(0) { array = new_deque_array(THREAD_POOL_DEQUE_INITIAL); }
+
+WorkDeque::~WorkDeque() {
+  FREE(array);
+  for (int i = 0; i < retired.n; i++) FREE(retired.v[i]);
+}
+
+void WorkDeque::grow() {
+  Array *a = array, *na = new_deque_array((a->mask + 1) * 2);
+  for (int64 i = top; i < bottom; i++) na->v[i & na->mask] = a->v[i & a->mask];
+  retired.add(a);
+  __atomic_store_n(&array, na, __ATOMIC_RELEASE);
+}
+
+void WorkDeque::push(ThreadPoolJob *job) {
+  int64 b = __atomic_load_n(&bottom, __ATOMIC_RELAXED);
+  int64 t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+  Array *a = __atomic_load_n(&array, __ATOMIC_RELAXED);
+  if (b - t > a->mask) {
+    grow();
+    a = array;
+  }
+  __atomic_store_n(&a->v[b & a->mask], job, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+ThreadPoolJob *WorkDeque::pop() {
+  int64 b = __atomic_load_n(&bottom, __ATOMIC_RELAXED) - 1;
+  Array *a = __atomic_load_n(&array, __ATOMIC_RELAXED);
+  __atomic_store_n(&bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64 t = __atomic_load_n(&top, __ATOMIC_RELAXED);
+  ThreadPoolJob *job = 0;
+  if (t <= b) {
+    job = __atomic_load_n(&a->v[b & a->mask], __ATOMIC_RELAXED);
+    if (t == b) {  // last one, race the thieves for it
+      if (!__atomic_compare_exchange_n(&top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) job = 0;
+      __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+    }
+  } else
+    __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+  return job;
+}
+
+ThreadPoolJob *WorkDeque::steal() {
+  int64 t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64 b = __atomic_load_n(&bottom, __ATOMIC_ACQUIRE);
+  if (t >= b) return 0;
+  Array *a = __atomic_load_n(&array, __ATOMIC_ACQUIRE);
+  ThreadPoolJob *job = __atomic_load_n(&a->v[t & a->mask], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return 0;
+  return job;
+}
+
+ThreadPoolWorker::ThreadPoolWorker(ThreadPool *apool, int aid) : pool(apool), id(aid), active(0), cpu(-1), node(0) {
+  rnd = (uint64)(uintptr_t)this ^ ((uint64)aid << 32) ^ 0x9E3779B97F4A7C15ULL;
+}
+
+static inline uint64 worker_rand(ThreadPoolWorker *w) {  // xorshift64
+  uint64 x = w->rnd;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return w->rnd = x;
+}
+
+void ThreadPool::init_work_stealing() {
+  pthread_mutex_lock(&mutex);
+  if (!workers) {
+    nnodes = numa ? numa_node_count() : 1;
+    nodes = new ThreadPoolNode[nnodes];
+    ws_job_freelist = new ConcurrentObjectFreeList<ThreadPoolJob>;
+    ThreadPoolWorker **w = (ThreadPoolWorker **)MALLOC(sizeof(ThreadPoolWorker *) * THREAD_POOL_MAX_WORKERS);
+    memset(w, 0, sizeof(ThreadPoolWorker *) * THREAD_POOL_MAX_WORKERS);
+    __atomic_store_n(&workers, w, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+ThreadPoolWorker *ThreadPool::current_worker() {
+  ThreadPoolWorker *w = TLS(thread_pool_worker);
+  return (w && w->pool == this) ? w : 0;
+}
+
+ThreadPoolWorker *ThreadPool::ws_attach() {
+  pthread_mutex_lock(&mutex);
+  ThreadPoolWorker *w = 0;
+  for (int i = 0; i < nworkers; i++)
+    if (!workers[i]->active) {
+      w = workers[i];
+      break;
+    }
+  if (!w) {
+    assert(nworkers < THREAD_POOL_MAX_WORKERS);
+    w = new ThreadPoolWorker(this, nworkers);
+    workers[nworkers] = w;
+    __atomic_store_n(&nworkers, nworkers + 1, __ATOMIC_RELEASE);
+  }
+  w->active = 1;
+  pthread_mutex_unlock(&mutex);
+  return w;
+}
+
+// returns 1 if the worker should exit, retire if it has been idle for idle_timeout
+int ThreadPool::ws_detach(ThreadPoolWorker *w, int retire) {
+  int r = 0;
+  pthread_mutex_lock(&mutex);
+  if (nthreads > maxthreads || (retire && nthreads > minthreads)) {
+    exit_thread_stats();
+    nthreads--;
+    w->active = 0;
+    r = 1;
+    if (!nthreads) pthread_cond_broadcast(&shutdown_condition);
+  }
+  pthread_mutex_unlock(&mutex);
+  return r;
+}
+
+// wake min(n, idle) workers and start threads for the rest
+void ThreadPool::ws_wake(int n) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int waiting = __atomic_load_n(&idle.waiters, __ATOMIC_SEQ_CST);
+  if (waiting) idle.notify(n < waiting ? n : waiting);
+  if (n <= waiting) return;
+  int t = __atomic_load_n(&nthreads, __ATOMIC_RELAXED);
+  if (t >= thread_limit()) return;
+  if (__atomic_load_n(&monitoring, __ATOMIC_RELAXED) && t >= minthreads) return;  // absorbing a burst
+  pthread_mutex_lock(&mutex);
+  for (int i = waiting; i < n && may_spawn(); i++) start_thread(this);
+  pthread_mutex_unlock(&mutex);
+}
+
+static inline void publish_counts(ThreadPoolNode *node) {
+  for (int i = 0; i < THREAD_POOL_PRIORITIES; i++)
+    __atomic_store_n(&node->njobs[i], node->jobs.count(i), __ATOMIC_SEQ_CST);
+}
+
+void ThreadPool::ws_enqueue(ThreadPoolJob **ajobs, int n, void *(*start)(void *), void **data, int priority,
+                            uint64 deadline) {
+  if (!stealing()) init_work_stealing();
+  ThreadPoolWorker *w = current_worker();
+  ThreadPoolNode *node = 0;
+  uint64 queued = stat_enqueued(n);
+  for (int i = 0; i < n; i++) {
+    ThreadPoolJob *job = ajobs ? ajobs[i] : 0;
+    int local = w && (job ? job->priority == THREAD_POOL_NORMAL && !job->deadline
+                          : priority == THREAD_POOL_NORMAL && !deadline);
+    if (local) {
+      if (!job) job = ws_job_freelist->alloc();
+      if (ajobs)
+        job->queued = queued;
+      else
+        set_job(job, start, data[i], priority, deadline, queued);
+      w->deque.push(job);
+      continue;
+    }
+    if (!node) {
+      node = local_node();
+      pthread_mutex_lock(&node->mutex);
+    }
+    if (!job) job = ws_job_freelist->alloc();
+    if (ajobs)
+      job->queued = queued;
+    else
+      set_job(job, start, data[i], priority, deadline, queued);
+    node->jobs.enqueue(job);
+  }
+  if (node) {
+    publish_counts(node);
+    pthread_mutex_unlock(&node->mutex);
+  }
+  ws_wake(n);
+}
+
+// take a job at priority <= lowest from the shared queues, local node first
+ThreadPoolJob *ThreadPool::ws_take_shared(ThreadPoolWorker *w, int lowest) {
+  for (int i = 0; i < nnodes; i++) {
+    ThreadPoolNode *node = &nodes[(w->node + i) % nnodes];
+    if (!node->has_jobs(lowest)) continue;
+    pthread_mutex_lock(&node->mutex);
+    ThreadPoolJob *job = node->jobs.dequeue(lowest);
+    int n = 0;
+    // plain FIFO jobs may be moved to the deque once no deadline job would run after them
+    if (lowest >= THREAD_POOL_NORMAL && !node->jobs.deadlines[THREAD_POOL_NORMAL].n) {
+      n = node->jobs.fifo[THREAD_POOL_NORMAL].size / (nthreads ? nthreads : 1);
+      if (n > THREAD_POOL_INJECT_BATCH) n = THREAD_POOL_INJECT_BATCH;
+      for (int i = 0; i < n; i++) w->deque.push(node->jobs.fifo[THREAD_POOL_NORMAL].dequeue());
+      node->jobs.size -= n;
+    }
+    publish_counts(node);
+    pthread_mutex_unlock(&node->mutex);
+    if (n) idle.notify(n);
+    if (job) return job;
+  }
+  return 0;
+}
+
+// steal from a random victim, within the node first
+ThreadPoolJob *ThreadPool::ws_steal(ThreadPoolWorker *w) {
+  int n = __atomic_load_n(&nworkers, __ATOMIC_ACQUIRE);
+  if (n < 2) return 0;
+  int start = worker_rand(w) % n;
+  for (int local = nnodes > 1; local >= 0; local--)
+    for (int i = 0; i < n; i++) {
+      ThreadPoolWorker *v = workers[(start + i) % n];
+      if (v == w || (local && v->node != w->node)) continue;
+      if (ThreadPoolJob *job = v->deque.steal()) {
+        if (stats) thread_stats()->add(THREAD_POOL_STAT_STEALS, 1);
+        return job;
+      }
+    }
+  return 0;
+}
+
+int ThreadPool::ws_has_work() {
+  for (int i = 0; i < nnodes; i++)
+    if (nodes[i].has_jobs(THREAD_POOL_BACKGROUND)) return 1;
+  int n = __atomic_load_n(&nworkers, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < n; i++)
+    if (workers[i]->deque.size() > 0) return 1;
+  return 0;
+}
+
+ThreadPoolJob *ThreadPool::ws_get_job(ThreadPoolWorker *w) {
+  while (1) {
+    ThreadPoolJob *job = ws_take_shared(w, THREAD_POOL_INTERACTIVE);
+    if (!job) job = w->deque.pop();
+    if (!job) job = ws_take_shared(w, THREAD_POOL_NORMAL);
+    if (!job) job = ws_steal(w);
+    if (!job) job = ws_take_shared(w, THREAD_POOL_BACKGROUND);
+    if (job) return job;
+    uint32_t key = idle.prepare_wait();
+    if (ws_has_work()) {
+      idle.cancel_wait();
+      continue;
+    }
+    if (__atomic_load_n(&nthreads, __ATOMIC_RELAXED) > __atomic_load_n(&maxthreads, __ATOMIC_RELAXED)) {
+      idle.cancel_wait();
+      if (ws_detach(w)) return 0;
+      continue;
+    }
+    int r;
+    __atomic_fetch_add(&nthreadswaiting, 1, __ATOMIC_SEQ_CST);
+    if (idle_timeout > 0 && __atomic_load_n(&nthreads, __ATOMIC_RELAXED) > minthreads) {
+      struct timespec ts;
+      hrtime_to_ts(idle_timeout * HRTIME_MSEC, &ts);
+      r = idle.wait(key, &ts);
+    } else
+      r = idle.wait(key);
+    __atomic_fetch_sub(&nthreadswaiting, 1, __ATOMIC_SEQ_CST);
+    if (r < 0 && !ws_has_work() && ws_detach(w, 1)) {
+      if (stats) thread_stats()->add(THREAD_POOL_STAT_RETIREMENTS, 1);
+      return 0;
+    }
+  }
+}
+
+/*
+  Futures
+
+  A future is itself the job added to the pool.  It holds one reference for
+  the caller and one which is dropped when it completes.  Continuations are
+  pushed on a lock-free list which is closed when the future completes.
+*/
+
+#define FUTURE_CLOSED ((ThreadPoolFuture *)(intptr_t)1)
+
+ThreadPoolFuture *ThreadPool::alloc_future() {
+  pthread_mutex_lock(&future_mutex);
+  ThreadPoolFuture *f = future_freelist.alloc();
+  pthread_mutex_unlock(&future_mutex);
+  f->pool = this;
+  f->refs = 2;
+  return f;
+}
+
+void ThreadPool::free_future(ThreadPoolFuture *f) {
+  pthread_mutex_lock(&future_mutex);
+  future_freelist.free(f);
+  pthread_mutex_unlock(&future_mutex);
+}
+
+ThreadPoolFuture *ThreadPool::add_job_future(void *(*start)(void *), void *data, int priority, uint64 deadline) {
+  ThreadPoolFuture *f = alloc_future();
+  f->start = start;
+  f->data = data;
+  f->priority = priority;
+  f->deadline = deadline;
+  add_job(f);
+  return f;
+}
+
+ThreadPoolFuture *ThreadPool::add_job_future(ThreadPoolJob *job) {
+  ThreadPoolFuture *f = alloc_future();
+  f->job = job;
+  f->priority = job->priority;
+  f->deadline = job->deadline;
+  add_job(f);
+  return f;
+}
+
+int ThreadPoolFuture::main() {
+  void *r;
+  if (then_fn)
+    r = then_fn(data, result);  // result holds the antecedent's result until now
+  else if (job)
+    r = (void *)(intptr_t)job->main();
+  else
+    r = start(data);
+  complete(r);
+  return 0;
+}
+
+void ThreadPoolFuture::complete(void *aresult) {
+  result = aresult;
+  uint32_t s = __atomic_exchange_n(&state, FUTURE_DONE, __ATOMIC_ACQ_REL);
+  if (s & FUTURE_WAITING) futex_wake(&state);
+  ThreadPoolFuture *c = __atomic_exchange_n(&continuations, FUTURE_CLOSED, __ATOMIC_ACQ_REL);
+  release();
+  while (c) {  // run on this worker, saving a trip through the queue
+    ThreadPoolFuture *n = c->next_continuation;
+    c->result = aresult;
+    c->main();
+    c = n;
+  }
+}
+
+void *ThreadPoolFuture::wait() {
+  while (1) {
+    uint32_t s = __atomic_load_n(&state, __ATOMIC_ACQUIRE);
+    if (s & FUTURE_DONE) return result;
+    if (!(s & FUTURE_WAITING) &&
+        !__atomic_compare_exchange_n(&state, &s, s | FUTURE_WAITING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      continue;
+    futex_wait(&state, FUTURE_WAITING);
+  }
+}
+
+ThreadPoolFuture *ThreadPoolFuture::then(void *(*fn)(void *data, void *result), void *adata) {
+  ThreadPoolFuture *f = pool->alloc_future();
+  f->then_fn = fn;
+  f->data = adata;
+  f->priority = priority;
+  f->deadline = deadline;
+  ThreadPoolFuture *c = __atomic_load_n(&continuations, __ATOMIC_ACQUIRE);
+  while (1) {
+    if (c == FUTURE_CLOSED) {
+      f->result = result;
+      pool->add_job(f);
+      break;
+    }
+    f->next_continuation = c;
+    if (__atomic_compare_exchange_n(&continuations, &c, f, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) break;
+  }
+  return f;
+}
+
+void ThreadPoolFuture::release() {
+  if (!__atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL)) pool->free_future(this);
+}
+
+ThreadPool::ThreadPool(int astacksize, int amaxthreads, int awork_stealing) {
   maxthreads = amaxthreads;
   stacksize = astacksize;
   nthreadswaiting = nthreads = 0;
+  minthreads = 0;
+  idle_timeout = 0;
+  spawn_delay = 0;
+  monitoring = 0;
+  stats_name = 0;
+  stats = 0;
+  work_stealing = awork_stealing;
+  workers = 0;
+  nworkers = 0;
+  nodes = 0;
+  nnodes = 0;
+  ws_job_freelist = 0;
+  cpus = 0;
+  numa = 0;
+  nplaced = 0;
   pthread_mutexattr_t mattr;
   pthread_mutexattr_init(&mattr);
   pthread_mutex_init(&mutex, &mattr);
+  pthread_mutex_init(&future_mutex, &mattr);
   pthread_condattr_t cattr;
   pthread_condattr_init(&cattr);
   pthread_cond_init(&condition, &cattr);
@@ -104,16 +929,233 @@ ThreadPool::ThreadPool(int astacksize, int amaxthreads) {
 void ThreadPool::shutdown() {
   pthread_mutex_lock(&mutex);
   int saved_maxthreads = maxthreads;
-  maxthreads = 0;
+  __atomic_store_n(&maxthreads, 0, __ATOMIC_SEQ_CST);
   pthread_cond_signal(&condition);
-  while (nthreads) pthread_cond_wait(&shutdown_condition, &mutex);
+  idle.notify_all();
+  while (nthreads || monitoring) pthread_cond_wait(&shutdown_condition, &mutex);
   maxthreads = saved_maxthreads;
   pthread_mutex_unlock(&mutex);
 }
 
+/*
+  Take back the jobs left queued by shutdown(), while no threads are
+  running.  Those added as a ThreadPoolJob are passed to fn (outside the
+  pool's locks), the others are dropped.  Returns the number taken.
+*/
+int ThreadPool::drain(void (*fn)(ThreadPoolJob *job)) {
+  Vec<ThreadPoolJob *> taken;
+  pthread_mutex_lock(&mutex);
+  while (ThreadPoolJob *job = jobs.dequeue()) taken.add(job);
+  for (int i = 0; i < nnodes; i++) {
+    pthread_mutex_lock(&nodes[i].mutex);
+    while (ThreadPoolJob *job = nodes[i].jobs.dequeue()) taken.add(job);
+    publish_counts(&nodes[i]);
+    pthread_mutex_unlock(&nodes[i].mutex);
+  }
+  for (int i = 0; i < nworkers; i++)
+    if (workers[i])
+      while (ThreadPoolJob *job = workers[i]->deque.pop()) taken.add(job);
+  for (int i = 0; i < taken.n; i++) {
+    ThreadPoolJob *job = taken[i];
+    if (job->queued) thread_stats()->add(THREAD_POOL_STAT_QUEUE_DEPTH, -1);
+    if (job->thread_pool_integral) continue;
+    if (stealing())
+      ws_job_freelist->free(job);
+    else
+      job_freelist.free(job);
+    taken[i] = 0;
+  }
+  pthread_mutex_unlock(&mutex);
+  for (int i = 0; i < taken.n; i++)
+    if (taken[i]) fn(taken[i]);
+  return taken.n;
+}
+
 ThreadPool::~ThreadPool() {
   shutdown();
+  for (int i = 0; i < nworkers; i++) delete workers[i];
+  if (workers) FREE(workers);
+  delete[] nodes;
+  delete ws_job_freelist;
+  if (stats) {
+    stats->unregister_stats(0);
+    delete stats;
+  }
   pthread_mutex_destroy(&mutex);
+  pthread_mutex_destroy(&future_mutex);
   pthread_cond_destroy(&condition);
   pthread_cond_destroy(&shutdown_condition);
 }
+
+#ifdef TEST_LIB
+static volatile int test_thread_pool_count = 0;
+
+static void *test_thread_pool_fn(void *data) {
+  ThreadPool *pool = (ThreadPool *)data;
+  int n = __atomic_add_fetch(&test_thread_pool_count, 1, __ATOMIC_SEQ_CST);
+  if (pool && n < 1000) {  // fan out from inside the pool
+    pool->add_job(test_thread_pool_fn, pool);
+    pool->add_job(test_thread_pool_fn, pool);
+  }
+  return 0;
+}
+
+static void *test_thread_pool_add(void *data) { return (void *)((intptr_t)data + 1); }
+
+static void *test_thread_pool_then(void *data, void *result) { return (void *)((intptr_t)data + (intptr_t)result); }
+
+static volatile int test_thread_pool_gate = 0;
+static volatile int test_thread_pool_order[8];
+
+static void *test_thread_pool_block(void *data) {
+  __atomic_store_n(&test_thread_pool_gate, 1, __ATOMIC_SEQ_CST);
+  for (int i = 0; i < 10000 && __atomic_load_n(&test_thread_pool_gate, __ATOMIC_SEQ_CST) == 1; i++)
+    wait_for(HRTIME_MSEC);
+  return 0;
+}
+
+static void *test_thread_pool_record(void *data) {
+  int n = __atomic_fetch_add(&test_thread_pool_count, 1, __ATOMIC_SEQ_CST);
+  test_thread_pool_order[n] = (int)(intptr_t)data;
+  return 0;
+}
+
+static volatile int test_thread_pool_peak = 0;
+
+static void *test_thread_pool_sleep(void *data) {
+  ThreadPool *pool = (ThreadPool *)data;
+  int t = __atomic_load_n(&pool->nthreads, __ATOMIC_SEQ_CST), p = test_thread_pool_peak;
+  while (t > p && !__atomic_compare_exchange_n(&test_thread_pool_peak, &p, t, false, __ATOMIC_SEQ_CST,
+                                               __ATOMIC_SEQ_CST)) {
+  }
+  wait_for(2 * HRTIME_MSEC);
+  __atomic_add_fetch(&test_thread_pool_count, 1, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+static int64 test_thread_pool_vm() {  // pages mapped, 0 where unknown
+  long long pages = 0;
+#ifdef __linux__
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp) {
+    if (fscanf(fp, "%lld", &pages) != 1) pages = 0;
+    fclose(fp);
+  }
+#endif
+  return pages;
+}
+
+static void test_thread_pool_wait(int n) {
+  for (int i = 0; i < 10000 && __atomic_load_n(&test_thread_pool_count, __ATOMIC_SEQ_CST) < n; i++)
+    wait_for(HRTIME_MSEC);
+}
+
+void test_threadpool() {
+  for (int ws = 0; ws < 2; ws++) {
+    ThreadPool pool(0, 4, ws);
+    if (ws) {
+      pool.cpus = "0";
+      pool.numa = 1;
+    }
+    test_thread_pool_count = 0;
+    for (int i = 0; i < 100; i++) pool.add_job(test_thread_pool_fn, 0);
+    test_thread_pool_wait(100);
+    assert(test_thread_pool_count == 100);
+    pool.shutdown();
+    test_thread_pool_count = 0;
+    pool.add_job(test_thread_pool_fn, &pool);
+    test_thread_pool_wait(1001);
+    assert(test_thread_pool_count >= 1000);
+    pool.shutdown();
+    void *data[64];
+    for (int i = 0; i < 64; i++) data[i] = 0;
+    test_thread_pool_count = 0;
+    pool.add_jobs(test_thread_pool_fn, data, 64);
+    test_thread_pool_wait(64);
+    assert(test_thread_pool_count == 64);
+    ThreadPoolFuture *f = pool.add_job_future(test_thread_pool_add, (void *)(intptr_t)1);
+    ThreadPoolFuture *g = f->then(test_thread_pool_then, (void *)(intptr_t)10);
+    ThreadPoolFuture *h = g->then(test_thread_pool_then, (void *)(intptr_t)100);
+    assert((intptr_t)h->wait() == 112);
+    assert(f->poll() && (intptr_t)f->wait() == 2);
+    ThreadPoolFuture *k = f->then(test_thread_pool_then, (void *)(intptr_t)1000);  // already complete
+    assert((intptr_t)k->wait() == 1002);
+    f->release();
+    g->release();
+    h->release();
+    k->release();
+    // one thread, so jobs queued behind a blocker run in priority then deadline order
+    ThreadPool prio(0, 1, ws);
+    test_thread_pool_gate = 0;
+    prio.add_job(test_thread_pool_block, 0);
+    for (int i = 0; i < 10000 && !__atomic_load_n(&test_thread_pool_gate, __ATOMIC_SEQ_CST); i++)
+      wait_for(HRTIME_MSEC);
+    test_thread_pool_count = 0;
+    prio.add_job(test_thread_pool_record, (void *)5, THREAD_POOL_BACKGROUND);
+    prio.add_job(test_thread_pool_record, (void *)4);
+    prio.add_job(test_thread_pool_record, (void *)3, THREAD_POOL_NORMAL, 200);
+    ThreadPoolFuture *f2 = prio.add_job_future(test_thread_pool_record, (void *)2, THREAD_POOL_NORMAL, 100);
+    ThreadPoolFuture *f1 = prio.add_job_future(test_thread_pool_record, (void *)1, THREAD_POOL_INTERACTIVE);
+    __atomic_store_n(&test_thread_pool_gate, 2, __ATOMIC_SEQ_CST);
+    test_thread_pool_wait(5);
+    assert(test_thread_pool_count == 5);
+    for (int i = 0; i < 5; i++) assert(test_thread_pool_order[i] == i + 1);
+    f1->release();
+    f2->release();
+    // grows under a backlog at one thread per spawn_delay, then retires back to minthreads
+    ThreadPool elastic(0, 4, ws);
+    elastic.minthreads = 1;
+    elastic.idle_timeout = 20;
+    elastic.spawn_delay = 200;
+    test_thread_pool_count = 0;
+    test_thread_pool_peak = 0;
+    for (int i = 0; i < 16; i++) elastic.add_job(test_thread_pool_sleep, &elastic);
+    test_thread_pool_wait(16);
+    assert(test_thread_pool_count == 16);
+    assert(test_thread_pool_peak > 1 && test_thread_pool_peak <= 4);
+    for (int i = 0; i < 1000 && __atomic_load_n(&elastic.nthreads, __ATOMIC_SEQ_CST) > 1; i++) wait_for(HRTIME_MSEC);
+    assert(elastic.nthreads == 1);
+    // threads which retire, and the monitor, are detached so repeated bursts leave no stacks behind
+    int64 vm = 0;
+    for (int burst = 0; burst < 10; burst++) {
+      if (burst == 2) vm = test_thread_pool_vm();
+      test_thread_pool_count = 0;
+      for (int i = 0; i < 16; i++) elastic.add_job(test_thread_pool_sleep, &elastic);
+      test_thread_pool_wait(16);
+      for (int i = 0; i < 1000 && (__atomic_load_n(&elastic.nthreads, __ATOMIC_SEQ_CST) > 1 ||
+                                   __atomic_load_n(&elastic.monitoring, __ATOMIC_SEQ_CST));
+           i++)
+        wait_for(HRTIME_MSEC);
+    }
+    assert(test_thread_pool_vm() - vm < (int64)(16 << 20) / getpagesize());
+    // thread stats are folded into the shared stats as threads exit
+    ThreadPool counted(0, 4, ws);
+    counted.stats_name = ws ? "test_ws_pool" : "test_pool";
+    test_thread_pool_count = 0;
+    for (int i = 0; i < 32; i++) counted.add_job(test_thread_pool_fn, 0);
+    test_thread_pool_wait(32);
+    counted.shutdown();
+    Stat *st = counted.stats->stat;
+    assert(st[THREAD_POOL_STAT_QUEUE_DEPTH].count == 0);
+    assert(st[THREAD_POOL_STAT_QUEUE_WAIT].count == 32 && st[THREAD_POOL_STAT_RUN_TIME].count == 32);
+    assert(st[THREAD_POOL_STAT_SPAWNS].count >= 1 && st[THREAD_POOL_STAT_SPAWNS].count <= 4);
+    int64 waits = 0, runs = 0;
+    for (int i = 0; i < THREAD_POOL_HISTOGRAM_BUCKETS; i++) {
+      waits += st[THREAD_POOL_STAT_QUEUE_WAIT_HIST + i].count;
+      runs += st[THREAD_POOL_STAT_RUN_TIME_HIST + i].count;
+    }
+    assert(waits == 32 && runs == 32);
+    {  // jobs added from outside the pool are reused, not leaked
+      ThreadPool outside(0, 4, ws);
+      for (int round = 0; round < 20; round++) {
+        test_thread_pool_count = 0;
+        for (int i = 0; i < 2000; i++) outside.add_job(test_thread_pool_fn, 0);
+        test_thread_pool_wait(2000);
+        FreeList &l = ws ? outside.ws_job_freelist->list : outside.job_freelist;
+        assert(l.allocated < 2 * 2000 * l.size);
+      }
+    }
+  }
+  printf("threadpool test\tPASSED\n");
+}
+#endif
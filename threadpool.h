@@ -4,10 +4,26 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#define THREAD_POOL_MAX_WORKERS 256     // work stealing worker slots
+#define THREAD_POOL_DEQUE_INITIAL 256   // must be a power of 2
+#define THREAD_POOL_INJECT_BATCH 16     // shared queue jobs moved to a worker deque at once
+#define THREAD_POOL_CACHE_LINE 64
+#define THREAD_POOL_MAX_NODES 64
+#define THREAD_POOL_HISTOGRAM_BUCKETS 24  // log2 usec, the last is open ended
+
+// priority lanes, a lane is only served when the more urgent lanes are empty
+#define THREAD_POOL_INTERACTIVE 0  // latency sensitive, e.g. connections
+#define THREAD_POOL_NORMAL 1
+#define THREAD_POOL_BACKGROUND 2  // bulk work, e.g. compaction and cleanup
+#define THREAD_POOL_PRIORITIES 3
+
 class ThreadPoolJob {
  public:
   void *(*start)(void *);
   void *data;
+  int priority;     // THREAD_POOL_INTERACTIVE .. THREAD_POOL_BACKGROUND
+  uint64 deadline;  // hrtime(), earliest first within the lane and ahead of jobs without one, 0 for none
+  uint64 queued;    // hrtime() when added, if the pool keeps stats
 
   virtual int main() {
     assert(!"no main();");
@@ -17,7 +33,151 @@ class ThreadPoolJob {
   int thread_pool_integral;
   LINK(ThreadPoolJob, thread_pool_link);
 
-  ThreadPoolJob() : thread_pool_integral(0) {}
+  ThreadPoolJob() : priority(THREAD_POOL_NORMAL), deadline(0), queued(0), thread_pool_integral(0) {}
+};
+
+class ThreadPool;
+
+#define THREAD_POOL_STAT_QUEUE_DEPTH 0  // count: added but not yet started
+#define THREAD_POOL_STAT_QUEUE_WAIT 1   // sum: usec from added to started, count: started
+#define THREAD_POOL_STAT_RUN_TIME 2     // sum: usec running, count: finished
+#define THREAD_POOL_STAT_SPAWNS 3
+#define THREAD_POOL_STAT_RETIREMENTS 4
+#define THREAD_POOL_STAT_STEALS 5
+#define THREAD_POOL_STAT_QUEUE_WAIT_HIST 6  // count: jobs which waited [2^(i-1), 2^i) usec
+#define THREAD_POOL_STAT_RUN_TIME_HIST (THREAD_POOL_STAT_QUEUE_WAIT_HIST + THREAD_POOL_HISTOGRAM_BUCKETS)
+#define THREAD_POOL_STATS (THREAD_POOL_STAT_RUN_TIME_HIST + THREAD_POOL_HISTOGRAM_BUCKETS)
+
+/*
+  Pool statistics, registered as global stats named "<stats_name>.<stat>".
+  Each pool thread updates its own copy without synchronization and
+  snap_stats() sums the copies.  Threads outside the pool update a shared
+  copy atomically.  A thread's values are folded into the shared copy when
+  it exits.
+*/
+class ThreadPoolStats {
+ public:
+  ThreadPool *pool;
+  int shared;
+  Stat stat[THREAD_POOL_STATS];
+
+  void add(int i, int64 count, int64 sum = 0) {
+    if (shared) {
+      __sync_fetch_and_add(&stat[i].sum, sum);
+      __sync_fetch_and_add(&stat[i].count, count);
+    } else {
+      stat[i].sum += sum;
+      stat[i].count += count;
+    }
+  }
+  void add_time(int i, int hist, uint64 usec);
+  void register_stats(cchar *prefix);
+  void unregister_stats(ThreadPoolStats *into);
+
+  ThreadPoolStats(ThreadPool *apool, int ashared);
+};
+
+// shared job queue: a FIFO and an earliest deadline first heap per priority lane
+class ThreadPoolQueue {
+ public:
+  CountQue(ThreadPoolJob, thread_pool_link) fifo[THREAD_POOL_PRIORITIES];
+  Vec<ThreadPoolJob *> deadlines[THREAD_POOL_PRIORITIES];
+  int size;
+
+  void enqueue(ThreadPoolJob *job);
+  ThreadPoolJob *dequeue(int lowest = THREAD_POOL_BACKGROUND);  // most urgent job at priority <= lowest
+  int count(int priority) { return fifo[priority].size + deadlines[priority].n; }
+
+  ThreadPoolQueue() : size(0) {}
+};
+
+/*
+  Completion handle for a job, from ThreadPool::add_job_future().
+
+  The result is the return value of start(data) (or of job->main()).  A
+  continuation added with then() runs on the worker which completes this job,
+  or is added to the pool if this job has already completed (with this job's
+  priority and deadline), and is passed the result.  Each handle must be
+  release()'d by its owner.
+*/
+#define FUTURE_DONE 1
+#define FUTURE_WAITING 2
+
+class ThreadPoolFuture : public ThreadPoolJob {
+ public:
+  ThreadPool *pool;
+  ThreadPoolJob *job;
+  void *(*then_fn)(void *data, void *result);
+  void *result;
+  volatile uint32_t state;
+  volatile int refs;
+  ThreadPoolFuture *volatile continuations;
+  ThreadPoolFuture *next_continuation;
+
+  int poll() { return __atomic_load_n(&state, __ATOMIC_ACQUIRE) & FUTURE_DONE; }
+  void *wait();
+  ThreadPoolFuture *then(void *(*fn)(void *data, void *result), void *data);
+  void release();
+
+  int main();
+  void complete(void *aresult);
+
+  ThreadPoolFuture()
+      : pool(0), job(0), then_fn(0), result(0), state(0), refs(0), continuations(0), next_continuation(0) {}
+};
+
+// Chase-Lev deque: the owner pushes and pops at the bottom, thieves steal from the top.
+class WorkDeque {
+ public:
+  struct Array {
+    int64 mask;
+    ThreadPoolJob *v[1];
+  };
+  alignas(THREAD_POOL_CACHE_LINE) volatile int64 top;
+  alignas(THREAD_POOL_CACHE_LINE) volatile int64 bottom;
+  Array *volatile array;
+  Vec<Array *> retired;  // thieves may still be reading, freed with the deque
+
+  void push(ThreadPoolJob *job);  // owner only
+  ThreadPoolJob *pop();           // owner only
+  ThreadPoolJob *steal();         // any thread
+  int64 size() { return __atomic_load_n(&bottom, __ATOMIC_ACQUIRE) - __atomic_load_n(&top, __ATOMIC_ACQUIRE); }
+  void grow();
+
+  WorkDeque();
+  ~WorkDeque();
+};
+
+class ThreadPoolWorker {
+ public:
+  WorkDeque deque;
+  ThreadPool *pool;
+  int id;
+  int active;
+  int cpu, node;  // placement, cpu is -1 if not pinned
+  uint64 rnd;  // victim selection
+
+  ThreadPoolWorker(ThreadPool *apool, int aid);
+};
+
+// work stealing shared queue, one per NUMA node when ThreadPool::numa is set
+class ThreadPoolNode {
+ public:
+  alignas(THREAD_POOL_CACHE_LINE) pthread_mutex_t mutex;
+  ThreadPoolQueue jobs;
+  volatile int njobs[THREAD_POOL_PRIORITIES];  // per lane, readable without the mutex
+
+  int has_jobs(int lowest) {
+    for (int i = 0; i <= lowest; i++)
+      if (__atomic_load_n(&njobs[i], __ATOMIC_SEQ_CST)) return 1;
+    return 0;
+  }
+
+  ThreadPoolNode() {
+    memset((void *)njobs, 0, sizeof(njobs));
+    pthread_mutex_init(&mutex, 0);
+  }
+  ~ThreadPoolNode() { pthread_mutex_destroy(&mutex); }
 };
 
 class ThreadPool {
@@ -25,19 +185,93 @@ class ThreadPool {
   pthread_mutex_t mutex;
   pthread_cond_t condition, shutdown_condition;
   int nthreads, nthreadswaiting, maxthreads, stacksize;
-  CountQue(ThreadPoolJob, thread_pool_link) jobs;
-  ClassFreeList<ThreadPoolJob> job_freelist;
+  ThreadPoolQueue jobs;
+  ObjectFreeList<ThreadPoolJob> job_freelist;
+
+  // work stealing mode, set before the first job is added
+  int work_stealing;
+  ThreadPoolWorker **workers;
+  int nworkers;  // slots ever used
+  ThreadPoolNode *nodes;
+  int nnodes;
+  ConcurrentObjectFreeList<ThreadPoolJob> *ws_job_freelist;  // a job may be freed by any thread
+  EventCount idle;
+
+  // elastic sizing
+  int minthreads;    // started without delay and never retired
+  int idle_timeout;  // msec, retire threads above minthreads idle this long, 0 for never
+  int spawn_delay;   // usec, above minthreads start at most one thread per interval while jobs wait, 0 for no delay
+  int monitoring;    // spawn monitor running
+
+  // statistics, set stats_name before the first job is added, 0 for none
+  cchar *stats_name;
+  ThreadPoolStats *stats;  // shared, 0 if not keeping stats
 
-  void add_job(void *(*start)(void *), void *data);
-  void add_job(ThreadPoolJob *job);
+  // placement, set before the first job is added
+  cchar *cpus;  // pin workers round robin to this cpulist (e.g. "0-7,16-23"), 0 for no pinning
+  int numa;     // work stealing: shared queue per NUMA node, steal within the node first
+  Vec<int> cpu_list;
+  int nplaced;
+
+  pthread_mutex_t future_mutex;
+  ObjectFreeList<ThreadPoolFuture> future_freelist;
+
+  void add_job(void *(*start)(void *), void *data, int priority = THREAD_POOL_NORMAL, uint64 deadline = 0);
+  void add_job(ThreadPoolJob *job);  // uses job->priority and job->deadline
+  // enqueue a batch under one lock and wake min(n, idle) workers
+  void add_jobs(void *(*start)(void *), void **data, int n, int priority = THREAD_POOL_NORMAL, uint64 deadline = 0);
+  void add_jobs(ThreadPoolJob **jobs, int n);
+  ThreadPoolFuture *add_job_future(void *(*start)(void *), void *data, int priority = THREAD_POOL_NORMAL,
+                                   uint64 deadline = 0);
+  ThreadPoolFuture *add_job_future(ThreadPoolJob *job);  // uses job->priority and job->deadline
   void shutdown();  // doesn't wait for queued but not running jobs
+  int drain(void (*fn)(ThreadPoolJob *job));  // after shutdown(), take back the queued jobs
 
-  ThreadPool(int astacksize = 0, int amaxthreads = INT_MAX);
+  ThreadPool(int astacksize = 0, int amaxthreads = INT_MAX, int awork_stealing = 0);
   ~ThreadPool();
   // public utility function
-  static pthread_t thread_create(void *(*start_routine)(void *), void *arg, int stacksize = 0);
+  static pthread_t thread_create(void *(*start_routine)(void *), void *arg, int stacksize = 0, int detached = 0);
   // private
-  int get_job(void *(**start)(void *), void **data, ThreadPoolJob **job);
+  int get_job(void *(**start)(void *), void **data, ThreadPoolJob **job, uint64 *queued);
+  void init_stats();
+  void check_stats() {
+    if (stats_name && !__atomic_load_n(&stats, __ATOMIC_ACQUIRE)) init_stats();
+  }
+  ThreadPoolStats *thread_stats();
+  void exit_thread_stats();
+  uint64 stat_enqueued(int n);
+  uint64 stat_started(uint64 queued);
+  void stat_finished(uint64 started);
+  void wake(int n);
+  int may_spawn();
+  int backlog();
+  void init_work_stealing();
+  void init_placement();
+  void place_thread(int *cpu, int *node);
+  ThreadPoolNode *local_node();
+  void ws_enqueue(ThreadPoolJob **jobs, int n, void *(*start)(void *) = 0, void **data = 0,
+                  int priority = THREAD_POOL_NORMAL, uint64 deadline = 0);
+  ThreadPoolWorker *current_worker();
+  ThreadPoolJob *ws_get_job(ThreadPoolWorker *w);
+  ThreadPoolJob *ws_take_shared(ThreadPoolWorker *w, int lowest);
+  ThreadPoolJob *ws_steal(ThreadPoolWorker *w);
+  int ws_has_work();
+  ThreadPoolWorker *ws_attach();
+  int ws_detach(ThreadPoolWorker *w, int retire = 0);
+  void ws_wake(int n = 1);
+  ThreadPoolFuture *alloc_future();
+  void free_future(ThreadPoolFuture *f);
+  bool stealing() { return __atomic_load_n(&workers, __ATOMIC_ACQUIRE) != 0; }
+  int thread_limit() {
+    int m = __atomic_load_n(&maxthreads, __ATOMIC_RELAXED);
+    return stealing() && m > THREAD_POOL_MAX_WORKERS ? THREAD_POOL_MAX_WORKERS : m;
+  }
 };
 
+void parse_cpulist(cchar *s, Vec<int> &cpus);  // e.g. "0-3,8,10-11"
+int numa_node_count();
+int numa_node_of_cpu(int cpu);
+
+void test_threadpool();
+
 #endif
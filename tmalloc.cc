@@ -0,0 +1,237 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#include "plib.h"
+#include "tmspace.h"
+
+#define TMALLOC_HEADER 4096  // TmallocRegion, a multiple of the page size
+#define TMALLOC_FAIL ((void *)~(size_t)0)
+
+struct TmallocRegion {  // at the start of each region
+  int large;            // a single allocation, otherwise a thread's mspace
+  size_t size;          // of the mapping
+  void *volatile remote;  // freed by other threads, linked through their first word
+  mspace ms;
+  TmallocRegion *next;  // abandoned
+};
+
+static TmallocRegion *tmalloc_abandoned = 0;
+static pthread_mutex_t tmalloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t tmalloc_key;
+static pthread_once_t tmalloc_key_once = PTHREAD_ONCE_INIT;
+
+static void make_tmalloc_key();
+
+// this thread's mspace, 0 until its first allocation
+#ifdef HAVE_TLS
+static __thread TmallocRegion *tmalloc_heap_tls = 0;
+static inline TmallocRegion *tmalloc_heap() { return tmalloc_heap_tls; }
+static inline void set_tmalloc_heap(TmallocRegion *h) { tmalloc_heap_tls = h; }
+#else
+static TmallocRegion *tmalloc_heap() {
+  pthread_once(&tmalloc_key_once, make_tmalloc_key);
+  return (TmallocRegion *)pthread_getspecific(tmalloc_key);
+}
+static inline void set_tmalloc_heap(TmallocRegion *h) {}  // tmalloc_key holds it
+#endif
+
+static inline TmallocRegion *region_of(void *p) { return (TmallocRegion *)((uintptr_t)p & ~(TMALLOC_REGION - 1)); }
+
+// n bytes aligned to TMALLOC_REGION
+static char *map_region(size_t n, int prot) {
+  size_t len = n + TMALLOC_REGION;
+  char *m = (char *)mmap(0, len, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (m == MAP_FAILED) return 0;
+  char *r = (char *)(((uintptr_t)m + TMALLOC_REGION - 1) & ~(TMALLOC_REGION - 1));
+  if (r > m) munmap(m, r - m);
+  if (m + len > r + n) munmap(r + n, m + len - (r + n));
+  return r;
+}
+
+// like sbrk() through the rest of the region
+static void *tmalloc_morecore(intptr_t increment, mspace ms) {
+  char *p = (char *)mspace_get_morecore_ptr(ms);
+  char *end = (char *)region_of(ms) + TMALLOC_REGION;
+  if (increment > 0) {
+    if (increment > end - p || mprotect(p, increment, PROT_READ | PROT_WRITE)) return TMALLOC_FAIL;
+  } else if (increment < 0) {
+    madvise(p + increment, -increment, MADV_DONTNEED);
+    mprotect(p + increment, -increment, PROT_NONE);
+  }
+  mspace_set_morecore_ptr(ms, p + increment);
+  return p;
+}
+
+static TmallocRegion *new_heap() {
+  char *r = map_region(TMALLOC_REGION, PROT_NONE);
+  if (!r || mprotect(r, TMALLOC_HEADER + TMALLOC_INITIAL, PROT_READ | PROT_WRITE)) return 0;
+  TmallocRegion *h = (TmallocRegion *)r;
+  h->large = 0;
+  h->size = TMALLOC_REGION;
+  h->remote = 0;
+  h->next = 0;
+  h->ms = create_mspace_with_base(r + TMALLOC_HEADER, TMALLOC_INITIAL, 0);
+  mspace_set_morecore(h->ms, tmalloc_morecore, r + TMALLOC_HEADER + TMALLOC_INITIAL);
+  return h;
+}
+
+static void collect(TmallocRegion *h) {
+  void *p = __atomic_exchange_n(&h->remote, (void *)0, __ATOMIC_ACQUIRE);
+  while (p) {
+    void *n = *(void **)p;
+    mspace_free(h->ms, p);
+    p = n;
+  }
+}
+
+static void tmalloc_thread_exit(void *data) {
+  TmallocRegion *h = (TmallocRegion *)data;
+  set_tmalloc_heap(0);
+  collect(h);
+  pthread_mutex_lock(&tmalloc_mutex);
+  h->next = tmalloc_abandoned;
+  tmalloc_abandoned = h;
+  pthread_mutex_unlock(&tmalloc_mutex);
+}
+
+static void make_tmalloc_key() { pthread_key_create(&tmalloc_key, tmalloc_thread_exit); }
+
+static TmallocRegion *attach() {
+  pthread_once(&tmalloc_key_once, make_tmalloc_key);
+  pthread_mutex_lock(&tmalloc_mutex);
+  TmallocRegion *h = tmalloc_abandoned;
+  if (h) tmalloc_abandoned = h->next;
+  pthread_mutex_unlock(&tmalloc_mutex);
+  if (!h && !(h = new_heap())) return 0;
+  pthread_setspecific(tmalloc_key, h);
+  set_tmalloc_heap(h);
+  return h;
+}
+
+static void *alloc_large(size_t n) {
+  size_t len = (TMALLOC_HEADER + n + TMALLOC_HEADER - 1) & ~(size_t)(TMALLOC_HEADER - 1);
+  TmallocRegion *r = (TmallocRegion *)map_region(len, PROT_READ | PROT_WRITE);
+  if (!r) return 0;
+  r->large = 1;
+  r->size = len;
+  return (char *)r + TMALLOC_HEADER;
+}
+
+void *tmalloc(size_t n) {
+  if (n >= TMALLOC_LARGE) return alloc_large(n);
+  TmallocRegion *h = tmalloc_heap();
+  if (!h && !(h = attach())) return 0;
+  if (h->remote) collect(h);
+  return mspace_malloc(h->ms, n);
+}
+
+void *tmemalign(size_t alignment, size_t n) {
+  if (n >= TMALLOC_LARGE && alignment <= TMALLOC_HEADER) return alloc_large(n);
+  TmallocRegion *h = tmalloc_heap();
+  if (!h && !(h = attach())) return 0;
+  if (h->remote) collect(h);
+  return mspace_memalign(h->ms, alignment, n);
+}
+
+void tfree(void *p) {
+  if (!p) return;
+  TmallocRegion *r = region_of(p);
+  if (r->large)
+    munmap(r, r->size);
+  else if (r == tmalloc_heap())
+    mspace_free(r->ms, p);
+  else {
+    void *h = __atomic_load_n(&r->remote, __ATOMIC_RELAXED);
+    do *(void **)p = h;
+    while (!__atomic_compare_exchange_n(&r->remote, &h, p, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+}
+
+void *trealloc(void *p, size_t n) {
+  if (!p) return tmalloc(n);
+  if (!n) {
+    tfree(p);
+    return 0;
+  }
+  TmallocRegion *r = region_of(p);
+  if (!r->large && r == tmalloc_heap() && n < TMALLOC_LARGE) return mspace_realloc(r->ms, p, n);
+  size_t old = r->large ? r->size - TMALLOC_HEADER : mspace_usable_size(p);
+  void *q = tmalloc(n);
+  if (!q) return 0;
+  memcpy(q, p, old < n ? old : n);
+  tfree(p);
+  return q;
+}
+
+void tmalloc_collect() {
+  if (TmallocRegion *h = tmalloc_heap()) collect(h);
+}
+
+size_t tmalloc_footprint() {
+  TmallocRegion *h = tmalloc_heap();
+  return h ? mspace_footprint(h->ms) : 0;
+}
+
+#ifdef TEST_LIB
+#define TEST_TMALLOC_BLOCKS 1000
+
+static void *test_tmalloc_blocks[TEST_TMALLOC_BLOCKS];
+static TmallocRegion *test_tmalloc_owner;
+
+static void *test_tmalloc_alloc(void *) {
+  for (int i = 0; i < TEST_TMALLOC_BLOCKS; i++) {
+    test_tmalloc_blocks[i] = tmalloc(i + 1);
+    memset(test_tmalloc_blocks[i], i & 0xFF, i + 1);
+  }
+  test_tmalloc_owner = tmalloc_heap();
+  return 0;
+}
+
+static void *test_tmalloc_adopt(void *) {
+  void *p = tmalloc(16);  // takes back the blocks freed by the main thread
+  assert(tmalloc_heap() == test_tmalloc_owner && !test_tmalloc_owner->remote);
+  tfree(p);
+  return 0;
+}
+
+void test_tmalloc() {
+  char *p = (char *)tmalloc(100);
+  assert(p && !((uintptr_t)p & 15) && region_of(p) == tmalloc_heap());
+  for (int i = 0; i < 100; i++) p[i] = (char)i;
+  p = (char *)trealloc(p, 100000);
+  assert(!((uintptr_t)p & 15));
+  for (int i = 0; i < 100; i++) assert(p[i] == (char)i);
+  tfree(p);
+  for (int i = 1; i < 200; i++) {  // as ::malloc, aligned for any type
+    void *q = tmalloc(i);
+    assert(!((uintptr_t)q & (alignof(max_align_t) - 1)));
+    q = trealloc(q, i * 3);
+    assert(!((uintptr_t)q & (alignof(max_align_t) - 1)));
+    tfree(q);
+  }
+  void *a = tmemalign(64, 1000);
+  assert(!((uintptr_t)a & 63));
+  tfree(a);
+  char *l = (char *)tmalloc(TMALLOC_LARGE);  // mapped on its own
+  assert(region_of(l)->large);
+  l[0] = l[TMALLOC_LARGE - 1] = 1;
+  l = (char *)trealloc(l, 10);
+  assert(l[0] == 1 && !region_of(l)->large);
+  tfree(l);
+  size_t footprint = tmalloc_footprint();
+  for (int i = 0; i < 100; i++) tfree(tmalloc(1 << 20));  // grows into the region and back
+  assert(tmalloc_footprint() >= footprint);
+  // freed by another thread, taken back by the thread which adopts the mspace
+  pthread_t t = create_thread(test_tmalloc_alloc, 0);
+  pthread_join(t, 0);
+  for (int i = 0; i < TEST_TMALLOC_BLOCKS; i++) {
+    assert(region_of(test_tmalloc_blocks[i]) == test_tmalloc_owner);
+    assert(((char *)test_tmalloc_blocks[i])[i] == (char)(i & 0xFF));
+    tfree(test_tmalloc_blocks[i]);
+  }
+  assert(test_tmalloc_owner->remote);
+  t = create_thread(test_tmalloc_adopt, 0);
+  pthread_join(t, 0);
+  printf("tmalloc test\tPASSED\n");
+}
+#endif
@@ -0,0 +1,38 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#ifndef _tmalloc_H_
+#define _tmalloc_H_
+
+#include <stddef.h>
+
+#define TMALLOC_REGION (1ULL << 32)  // address space reserved for each thread's mspace, a power of 2
+#define TMALLOC_INITIAL (1 << 20)    // committed when a thread's mspace is created
+#define TMALLOC_LARGE (1 << 26)      // allocations at least this large are mapped on their own
+
+/*
+  Thread caching malloc built on dlmalloc mspaces, selected for MALLOC etc.
+  by compiling with USE_TMALLOC (see plib.h).  Each thread allocates from
+  its own unlocked mspace, which grows through a region of address space
+  reserved for it, so the owner of any block is found by masking its
+  address.  A block freed by another thread is pushed onto the owner's
+  lock-free remote list and returned to the mspace by the owner on its next
+  allocation (or tmalloc_collect()).  When a thread exits its mspace is
+  left for the next new thread to adopt, along with anything still
+  outstanding.
+
+  Blocks are 16 byte aligned, as from ::malloc (tmalloc has its own
+  dlmalloc instance, see tmspace.h), use tmemalign() for more.  tfree() and trealloc() must only be given memory from these
+  functions.
+*/
+
+void *tmalloc(size_t n);
+void *trealloc(void *p, size_t n);
+void *tmemalign(size_t alignment, size_t n);
+void tfree(void *p);
+void tmalloc_collect();        // take back what other threads have freed
+size_t tmalloc_footprint();  // of this thread's mspace
+
+void test_tmalloc();
+
+#endif
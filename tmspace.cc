@@ -0,0 +1,7 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#define MALLOC_ALIGNMENT ((size_t)16U)
+#include "plib.h"
+#include "tmspace.h"
+#include "dlmalloc.cc"
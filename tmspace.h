@@ -0,0 +1,50 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#ifndef _tmspace_H_
+#define _tmspace_H_
+
+/*
+  tmalloc's own instance of dlmalloc (tmspace.cc), compiled with a
+  MALLOC_ALIGNMENT of 16 so that its blocks are aligned like ::malloc's.
+  The mspace functions are renamed here so that it links beside the
+  8 byte aligned instance used by persist.  Include after plib.h.
+*/
+
+#define create_mspace tmspace_create
+#define create_mspace_with_base tmspace_create_with_base
+#define destroy_mspace tmspace_destroy
+#define mspace_from_base tmspace_from_base
+#define mspace_set_morecore tmspace_set_morecore
+#define mspace_get_morecore_ptr tmspace_get_morecore_ptr
+#define mspace_set_morecore_ptr tmspace_set_morecore_ptr
+#define mspace_set_morecore_pfn tmspace_set_morecore_pfn
+#define mspace_usable_size tmspace_usable_size
+#define mspace_malloc tmspace_malloc
+#define mspace_free tmspace_free
+#define mspace_calloc tmspace_calloc
+#define mspace_realloc tmspace_realloc
+#define mspace_memalign tmspace_memalign
+#define mspace_independent_calloc tmspace_independent_calloc
+#define mspace_independent_comalloc tmspace_independent_comalloc
+#define mspace_trim tmspace_trim
+#define mspace_malloc_stats tmspace_malloc_stats
+#define mspace_footprint tmspace_footprint
+#define mspace_max_footprint tmspace_max_footprint
+#define mspace_mallinfo tmspace_mallinfo
+#define mspace_mallopt tmspace_mallopt
+
+extern "C" {
+mspace create_mspace_with_base(void *base, size_t capacity, int locked);
+void mspace_set_morecore(mspace msp, morecore_pfn_t amorecore_pfn, void *amorecore_ptr);
+void *mspace_get_morecore_ptr(mspace msp);
+void mspace_set_morecore_ptr(mspace msp, void *p);
+size_t mspace_usable_size(void *mem);
+void *mspace_malloc(mspace msp, size_t bytes);
+void mspace_free(mspace msp, void *mem);
+void *mspace_realloc(mspace msp, void *mem, size_t newsize);
+void *mspace_memalign(mspace msp, size_t alignment, size_t bytes);
+size_t mspace_footprint(mspace msp);
+}
+
+#endif
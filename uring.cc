@@ -0,0 +1,124 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#include "plib.h"
+
+#ifdef HAVE_IO_URING
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, 0, 0);
+}
+
+static int uring_register(int fd, unsigned op, void *arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, op, arg, nr_args);
+}
+
+int Uring::init(unsigned nentries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  if ((fd = uring_setup(nentries, &p)) < 0) return -1;
+  entries = p.sq_entries;
+  sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_ring_size > sq_ring_size) sq_ring_size = cq_ring_size;
+    cq_ring_size = sq_ring_size;
+  }
+  sq_ring = mmap(0, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) goto Lerror;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    cq_ring = sq_ring;
+  else {
+    cq_ring = mmap(0, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) goto Lerror;
+  }
+  sqes = (struct io_uring_sqe *)mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) goto Lerror;
+  sq_head = (unsigned *)((char *)sq_ring + p.sq_off.head);
+  sq_tail = (unsigned *)((char *)sq_ring + p.sq_off.tail);
+  sq_mask = *(unsigned *)((char *)sq_ring + p.sq_off.ring_mask);
+  sq_array = (unsigned *)((char *)sq_ring + p.sq_off.array);
+  cq_head = (unsigned *)((char *)cq_ring + p.cq_off.head);
+  cq_tail = (unsigned *)((char *)cq_ring + p.cq_off.tail);
+  cq_mask = *(unsigned *)((char *)cq_ring + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)((char *)cq_ring + p.cq_off.cqes);
+  sqe_tail = *sq_tail;
+  // the SQ array is an indirection we don't use: entry i is always sqes[i]
+  for (unsigned i = 0; i < entries; i++) sq_array[i] = i;
+  return 0;
+Lerror:
+  if (sq_ring == MAP_FAILED) sq_ring = 0;
+  if (cq_ring == MAP_FAILED) cq_ring = 0;
+  if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+  if (sq_ring) munmap(sq_ring, sq_ring_size);
+  sq_ring = cq_ring = 0;
+  sqes = 0;
+  ::close(fd);
+  fd = -1;
+  return -1;
+}
+
+Uring::~Uring() {
+  if (fd < 0) return;
+  munmap(sqes, entries * sizeof(struct io_uring_sqe));
+  if (cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+  munmap(sq_ring, sq_ring_size);
+  ::close(fd);
+}
+
+struct io_uring_sqe *Uring::get_sqe() {
+  if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= entries) submit();
+  struct io_uring_sqe *sqe = &sqes[sqe_tail & sq_mask];
+  memset((void *)sqe, 0, sizeof(*sqe));
+  sqe_tail++;
+  return sqe;
+}
+
+int Uring::submit(unsigned wait_nr) {
+  __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+  unsigned n = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  return uring_enter(fd, n, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+}
+
+// returns 0 if interrupted
+int Uring::wait(struct io_uring_cqe *cqe, int max) {
+  unsigned head = *cq_head, tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail || sqe_tail != __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)) {
+    if (submit(head == tail ? 1 : 0) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) return -1;
+    tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  }
+  int n = 0;
+  for (; head != tail && n < max; head++) cqe[n++] = cqes[head & cq_mask];
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+int Uring::register_files(int n) {
+  int *fds = (int *)MALLOC(sizeof(int) * n);
+  for (int i = 0; i < n; i++) fds[i] = -1;
+  int r = uring_register(fd, IORING_REGISTER_FILES, fds, n);
+  FREE(fds);
+  return r < 0 ? -1 : 0;
+}
+
+int Uring::update_file(int slot, int afd) {
+  struct io_uring_files_update u;
+  memset(&u, 0, sizeof(u));
+  u.offset = slot;
+  u.fds = (uint64)(uintptr_t)&afd;
+  return uring_register(fd, IORING_REGISTER_FILES_UPDATE, &u, 1) == 1 ? 0 : -1;
+}
+
+int Uring::register_buffer(void *buf, size_t len) {
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  return uring_register(fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0 ? -1 : 0;
+}
+
+#endif
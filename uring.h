@@ -0,0 +1,57 @@
+/* -*-Mode: c++;-*-
+   Copyright (c) 2026 John Plevyak, All Rights Reserved
+*/
+#ifndef _uring_H_
+#define _uring_H_
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#endif
+#endif
+
+/*
+  Minimal io_uring wrapper on the raw system calls (no liburing).
+
+  init() returns -1 if the kernel (or a seccomp policy) doesn't allow
+  io_uring, in which case callers use plain system calls instead.  SQEs are
+  filled in with get_sqe() and passed to the kernel by the next wait(), which
+  then copies out up to max completions, so each event loop iteration costs
+  one io_uring_enter for all of its submissions and completions.
+
+  Registered files: register_files(n) creates a sparse table (all -1) which
+  update_file() fills in and clears (fd -1) slot by slot.  A registered file
+  holds a reference, so clear the slot before close().  Registered buffers:
+  register_buffer() registers a single region as buffer index 0.
+*/
+
+#ifdef HAVE_IO_URING
+
+class Uring {
+ public:
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_array, sq_mask;
+  unsigned *cq_head, *cq_tail, cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned sqe_tail;  // filled in, published to the kernel by submit()
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+
+  int init(unsigned nentries);
+  struct io_uring_sqe *get_sqe();  // zeroed, submits first if the ring is full
+  int submit(unsigned wait_nr = 0);
+  int wait(struct io_uring_cqe *cqe, int max);  // submit and wait for at least one completion
+  int register_files(int n);
+  int update_file(int slot, int afd);
+  int register_buffer(void *buf, size_t len);
+
+  Uring() : fd(-1), sq_ring(0), cq_ring(0) {}
+  ~Uring();
+};
+
+#endif
+
+#endif
@@ -12,11 +12,14 @@ class UtilService : public Service {
   void stop();
 } util_service;
 
-int bind_port(int port, int protocol, bool nolinger) {
+int bind_port(int port, int protocol, bool nolinger, bool reuseport) {
   int fd = socket(AF_INET, protocol, 0);
   if (fd < 0) PERROR("socket");
   int one = 1;
   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one))) PERROR("setsockopt");
+#ifdef SO_REUSEPORT
+  if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&one, sizeof(one))) PERROR("setsockopt");
+#endif
   struct sockaddr_in name;
   memset(&name, 0, sizeof(name));
   name.sin_family = AF_INET;
@@ -30,7 +30,7 @@
 
 typedef uint64 hrtime_t;
 
-int bind_port(int port, int protocol = SOCK_STREAM, bool nolinger = false);
+int bind_port(int port, int protocol = SOCK_STREAM, bool nolinger = false, bool reuseport = false);
 int accept_socket(int socket, bool nolinger = false, bool tcp_nodelay = true, int set_buf_size = 0);
 int connect_socket(in_addr_t addr, int port, int client_buf_size = 0, bool client_nodelay = 1,
                    bool client_nolinger = 0);
@@ -103,6 +103,15 @@ class xrange {
   iterator begin() const { return iterator(first_, increment_); }
   iterator end() const { return iterator(last_); }
 
+  int first() const { return first_; }
+  int last() const { return last_; }
+  int increment() const { return increment_; }
+  int size() const {
+    if (increment_ > 0) return last_ > first_ ? (last_ - first_ + increment_ - 1) / increment_ : 0;
+    if (increment_ < 0) return first_ > last_ ? (first_ - last_ - increment_ - 1) / -increment_ : 0;
+    return 0;
+  }
+
  private:
   int first_ = 0;
   int last_ = 0;